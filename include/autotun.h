@@ -7,7 +7,9 @@
 #include <errno.h>
 
 #include "util.h"
+#include "event.h"
 #include <libssh/libssh.h>
+#include <libssh/callbacks.h>
 
 enum session_stat_vars {
 	NOT_CREATED,
@@ -17,25 +19,153 @@ enum session_stat_vars {
 };
 
 
+/* Scratch buffer for moving data between channels and clients, this is
+ * also the largest single read (see max_read) */
+#define CHAN_BUF_SIZE (4096 * 64)
+
+struct chan_sock;
+struct metrics_slot;
+
+struct cs_list {
+	struct chan_sock *head;
+	struct chan_sock *tail;
+	int n;
+};
+
+/* Sessions are connected and authenticated without blocking the loop */
+enum sess_state {
+	SESS_CONNECTING,
+	SESS_AUTHENTICATING,
+	SESS_UP,
+	SESS_FAILED,
+};
+
+/* Longest a session may take to come up, and how often one that is being
+ * set up is looked at when its socket stays quiet */
+#define SESS_SETUP_USEC (30 * 1000000)
+#define SESS_POLL_MS 20
+
+/* Reconnect back-off after a session is lost or can't be set up, doubling
+ * from the first to the last, each wait randomised over its upper half */
+#define RECONNECT_MIN_USEC (100 * 1000)
+#define RECONNECT_MAX_USEC (30 * 1000000)
+
+/* While there's no session clients are held this long, and at most this
+ * many of them, unless the config says otherwise */
+#define HOLD_USEC_DEFAULT (30 * 1000000)
+#define HOLD_MAX_DEFAULT 256
+
+/* Established sessions aren't probed unless the config says so, or the pool
+ * balances on round-trip time, which needs the probes.  A session is given
+ * up on after this many probe intervals without a reply. */
+#define KEEPALIVE_USEC_DEFAULT 0
+#define KEEPALIVE_RTT_USEC_DEFAULT (15 * 1000000)
+#define KEEPALIVE_MAX_DEFAULT 3
+
+/* How new channels are spread over a pool of gateways */
+enum gw_balance {
+	BALANCE_LEASTCONN,
+	BALANCE_RTT,
+};
+
+/* One gateway host of the section's pool, each has its own sessions and
+ * reconnect back-off so the others carry on while it's down */
+struct gw_member {
+	char *host;
+	ssh_session session;
+	uint64_t backoff_usec;
+	uint64_t retry_at;
+	bool reconnect[2];
+};
+
+/* One authenticated connection to the gateway, channels are spread over these */
+struct gw_session {
+	ssh_session session;
+	struct gw_member *member;
+	int state;
+	uint64_t deadline;
+	socket_t fd;
+	uint32_t events;
+	ssh_event ssh_ev;
+	int n_channels;
+	int chan_limit;
+	bool compressed;
+	uint64_t ka_next;
+	uint64_t ka_sent;
+	uint64_t rx_at;
+	bool ka_idle;
+	int ka_missed;
+	uint64_t rtt_usec;
+	uint64_t srtt_usec;
+};
+
 struct gw_host {
 	char *name;
+	int shard;
 	ssh_session session;
+	struct gw_member **members;
+	int n_members;
+	int balance;
+	struct gw_session **sess;
+	int n_sessions;
+	int min_sessions;
+	int max_sessions;
+	int comp_level;
+	struct fd_map *sess_fdmap;
 	char *auth;
+	ssh_key auth_key;
 	int local;
+	uint64_t idle_usec;
+	uint64_t idle_since;
+	unsigned int seed;
+	uint64_t hold_usec;
+	int hold_max;
+	uint64_t keepalive_usec;
+	int keepalive_max;
 	int n_maps;
+	bool draining;
+	unsigned int config_gen;
+	int n_conns;
+	int max_conns;
+	int n_paused;
+	int n_be_down;
+	struct ssh_channel_callbacks_struct chan_cb;
+	struct ptr_map *chan_map;
+	struct chan_sock *ready;
+	struct chan_sock *coalescing;
+	uint64_t pass;
+	struct chan_sock **closing;
+	int n_closing;
+	struct cs_list open_queue;
+	struct cs_list opening;
+	int max_opening;
+	bool pool_short;
+	sig_atomic_t stats_seen;
+	struct metrics_slot *metrics;
+	uint64_t worker_pass;
+	uint64_t wake_at;
 	struct fd_map *chan_sock_fdmap;
 	struct static_port_map **pm;
 	struct fd_map *listen_fdmap;
+	struct event_loop *ev;
 };
 
 void setup_signals_for_child(void);
 void setup_signals_parent(void);
 int select_loop(struct gw_host *gw);
+void gw_loop_start(struct gw_host *gw);
+int gw_loop_timeout(struct gw_host *gw);
+bool gw_loop_iter(struct gw_host *gw, int timeout, char *buf, size_t len);
+void gw_loop_end(struct gw_host *gw);
 struct gw_host *create_gw(const char *hostname);
 int run_gateway(struct gw_host *gw);
 void destroy_gw(struct gw_host *gw);
+void reload_gateway(struct gw_host *gw);
 
-extern bool finish_main_loop;
-extern bool hard_shutdown;
+/* Set from signal handlers, read by every worker thread: loads from other
+ * threads go through __atomic_load_n() so they're never hoisted */
+extern volatile sig_atomic_t finish_main_loop;
+extern volatile sig_atomic_t hard_shutdown;
+extern volatile sig_atomic_t reload_config;
 
 #endif
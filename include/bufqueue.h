@@ -0,0 +1,32 @@
+#ifndef _BUFQUEUE_H__
+#define _BUFQUEUE_H__
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define BUFQ_CHUNK_SIZE (4096 * 4)
+
+/* Most chunks handed to one sendmsg() */
+#define BUFQ_IOV_MAX 64
+
+struct buf_chunk {
+	struct buf_chunk *next;
+	size_t len;
+	size_t off;
+	size_t size;
+	char data[];
+};
+
+struct buf_queue {
+	struct buf_chunk *head;
+	struct buf_chunk *tail;
+	size_t bytes;
+};
+
+void init_bufq(struct buf_queue *q);
+void append_bufq(struct buf_queue *q, const void *data, size_t len);
+void consume_bufq(struct buf_queue *q, size_t len);
+ssize_t flush_bufq(struct buf_queue *q, int fd);
+void clear_bufq(struct buf_queue *q);
+
+#endif
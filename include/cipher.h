@@ -0,0 +1,10 @@
+#ifndef _CIPHER_H__
+#define _CIPHER_H__
+
+/* How long each cipher is run for in the startup benchmark */
+#define CIPHER_BENCH_USEC (20 * 1000)
+#define CIPHER_BENCH_BUF (4096 * 4)
+
+const char *fastest_ciphers(void);
+
+#endif
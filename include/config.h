@@ -7,6 +7,20 @@
 
 struct ini_file *
 read_configfile(const char *filename, struct ini_section **sec);
-struct gw_host *process_section_to_gw(struct ini_section *sec);
+struct ini_file *
+reread_configfile(const char *filename, struct ini_section **sec);
+void check_configfile(const char *filename);
+struct ini_file *
+read_checked_configfile(const char *filename, struct ini_section **sec);
+void setup_config_snapshots(void);
+struct gw_host *process_section_to_gw(struct ini_section *sec, int shard);
+int section_shards(struct ini_section *sec);
+void prepare_cipher_prefs(struct ini_section *sec);
+struct ini_section *find_gw_section(struct ini_section *sec, const char *name);
+bool same_gw_settings(struct ini_section *a, struct ini_section *b);
+void reload_gw(struct gw_host *gw, struct ini_section *first);
+
+extern char *cfgfile;
+extern char *stats_socket;
 
 #endif
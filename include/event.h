@@ -0,0 +1,22 @@
+#ifndef _EVENT_H__
+#define _EVENT_H__
+
+#include <stdint.h>
+#include <sys/epoll.h>
+
+#define EVENT_BATCH 256
+
+struct event_loop {
+	int epfd;
+	int max_events;
+	struct epoll_event *events;
+};
+
+struct event_loop *new_event_loop(int max_events);
+void event_add(struct event_loop *ev, int fd, uint32_t events);
+void event_mod(struct event_loop *ev, int fd, uint32_t events);
+void event_del(struct event_loop *ev, int fd);
+int event_wait(struct event_loop *ev, int timeout_ms);
+void del_event_loop(struct event_loop *ev);
+
+#endif
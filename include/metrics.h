@@ -0,0 +1,92 @@
+#ifndef _METRICS_H__
+#define _METRICS_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+/* Slots in the shared segment, one per gateway instance and one per map */
+#define METRICS_SLOTS 1024
+#define METRICS_NAME_MAX 64
+
+/* Latency histograms: METRICS_BUCKETS - 1 upper bounds (see metrics.c) and
+ * one bucket for anything slower */
+#define METRICS_BUCKETS 16
+
+/* Counters of a map, or of the maps a gateway has dropped: the one place
+ * they're kept, for the stats socket and the SIGUSR2 dump alike.  All
+ * uint64_t, they are summed and folded as an array. */
+struct metric_counters {
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	uint64_t n_accepted;
+	uint64_t n_active;
+	uint64_t n_failed;			/* Clients dropped without a channel */
+	uint64_t n_pool_hits;
+	uint64_t n_open_failed;		/* Channel opens, pooled ones too */
+	uint64_t n_coalesced;
+	uint64_t n_co_flushes;
+	uint64_t n_paused;
+	uint64_t n_shed;
+	uint64_t n_fd_full;
+	uint64_t n_hold_full;
+	uint64_t n_hold_expired;
+	uint64_t n_opened;
+	uint64_t open_usec;
+	uint64_t open_hist[METRICS_BUCKETS];
+	uint64_t n_ttfb;
+	uint64_t ttfb_usec;
+	uint64_t ttfb_hist[METRICS_BUCKETS];
+};
+
+enum metrics_slot_state {
+	SLOT_FREE,
+	SLOT_INIT,
+	SLOT_LIVE,
+};
+
+/**
+ * One gateway's or map's counters in the shared segment
+ *
+ * Only the thread running the gateway writes a slot, so updates are plain
+ * (relaxed atomic) stores with no lock; the parent reads them to serve the
+ * stats socket.  A gateway slot (local_port 0) holds the counters of maps
+ * that have gone, and the gateway's own gauges.
+ */
+struct metrics_slot {
+	uint32_t state;
+	pid_t pid;
+	int shard;
+	uint32_t local_port;
+	char gw_name[METRICS_NAME_MAX];
+	struct metric_counters c;
+	uint64_t n_sessions;
+	uint64_t n_sess_lost;
+};
+
+/* The single-writer add, no read-modify-write bus lock needed */
+static inline void metric_add(uint64_t *ctr, uint64_t n)
+{
+	__atomic_store_n(ctr, __atomic_load_n(ctr, __ATOMIC_RELAXED) + n,
+					 __ATOMIC_RELAXED);
+}
+
+static inline void metric_set(uint64_t *ctr, uint64_t v)
+{
+	__atomic_store_n(ctr, v, __ATOMIC_RELAXED);
+}
+
+void metrics_init(const char *path);
+void metrics_forked(void);
+void metrics_close(void);
+bool metrics_serving(void);
+void metrics_poll(int ms);
+void metrics_reclaim(pid_t pid);
+struct metrics_slot *metrics_slot_new(const char *gw_name, int shard,
+									  uint32_t local_port);
+void metrics_slot_free(struct metrics_slot *m, struct metrics_slot *into);
+void metrics_open_latency(struct metrics_slot *m, uint64_t usec);
+void metrics_ttfb(struct metrics_slot *m, uint64_t usec);
+uint64_t metrics_p99_usec(const uint64_t *hist, uint64_t count);
+
+#endif
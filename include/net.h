@@ -1,9 +1,34 @@
 #ifndef _NET_H__
 #define _NET_H__
 
+#include <stdbool.h>
+#include <stdint.h>
 
-int create_listen_socket(uint32_t local_port, const char *node);
-int accept_connection(int listenfd);
+
+/* Socket settings for a map's listener and the clients accepted on it */
+struct sock_opts {
+	int backlog;
+	bool reuseport;
+	int defer_accept;
+	int fastopen;
+	int rcvbuf;
+	int sndbuf;
+	bool nodelay;
+	int notsent_lowat;
+	int keepalive;
+};
+
+/* accept_connection() results other than a new fd */
+#define ACCEPT_NONE -1
+#define ACCEPT_SHED -2
+#define ACCEPT_FULL -3
+
+int create_listen_socket(uint32_t local_port, const char *node,
+						 const struct sock_opts *so);
+void reserve_spare_fd(void);
+int accept_connection(int listenfd, const struct sock_opts *so);
+int set_nonblocking(int fd);
+uint32_t peer_addr_hash(int fd);
 
 
 #endif
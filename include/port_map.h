@@ -3,11 +3,147 @@
 
 #include <libssh/libssh.h>
 #include "autotun.h"
+#include "bufqueue.h"
+#include "stats.h"
+#include "socks.h"
+#include "net.h"
+#include "metrics.h"
+
+/* Stop reading a channel once this much is queued for its client, and
+ * start again when the client has drained it down to the low mark */
+#define CHAN_OUTQ_HIWAT (4096 * 64)
+#define CHAN_OUTQ_LOWAT (4096 * 16)
+
+/* Per-connection read sizes adapt between these, see adapt_read_size() */
+#define READ_SIZE_MIN 2048
+#define READ_SIZE_INIT (4096 * 4)
+
+/* Most bytes moved for one connection in one direction per pass */
+#define DRAIN_BUDGET (4096 * 128)
+
+/* Coalesced client data goes to the channel once this much is gathered,
+ * unless the map sets coalesce_bytes */
+#define COALESCE_BYTES_DEFAULT 8192
+
+/* Client bytes we'll buffer while the channel is still being opened */
+#define CHAN_EARLY_MAX (4096 * 16)
+
+/* Default number of channel opens in flight per gateway */
+#define MAX_PENDING_OPENS 32
+
+/* Per-map compression: which of the gateway's session groups carries it */
+enum map_comp {
+	COMP_OFF,
+	COMP_ON,
+	COMP_AUTO,
+};
+
+/* Bytes of a map's traffic looked at to estimate how well it compresses,
+ * and the entropy (bits per byte) above which it's not worth compressing */
+#define COMP_SAMPLE_BYTES (4096 * 16)
+#define COMP_ENTROPY_MAX 7.0
+
+struct comp_sample {
+	uint32_t n;
+	uint32_t count[256];
+};
+
+/* How a map with several backends spreads its connections over them */
+enum map_balance {
+	BACKEND_LEASTCONN,
+	BACKEND_RR,
+	BACKEND_SOURCE,
+};
+
+/* How often a backend taken out of rotation is tried with a probe open */
+#define BACKEND_PROBE_USEC (5 * 1000000)
+
+/**
+ * One destination of a map
+ *
+ * A backend whose open fails is taken out of rotation (down) while the map
+ * has others, until a probe open to it gets through.  One dropped by a
+ * reload stays around, removed, as connections may still point at it.
+ */
+struct backend {
+	char *host;
+	uint32_t port;
+	int n_channels;
+	bool down;
+	bool removed;
+	bool probing;
+	uint64_t probe_at;
+	uint64_t n_opened;
+	uint64_t n_failed;
+};
+
+/* Per-map settings, each can also be set for all maps in the section */
+struct map_opts {
+	int pool_size;
+	int shards;
+	int max_conns;
+	int max_read;
+	int coalesce_usec;
+	int coalesce_bytes;
+	int compression;
+	int balance;
+	struct sock_opts sock;
+};
+
+/* How often a listener whose port is still taken is tried again */
+#define LISTEN_RETRY_USEC (1000 * 1000)
+
+/* Most connections taken off a listener per wakeup, the rest wait a pass */
+#define ACCEPT_BUDGET 64
+
+/* How long a listener rests after we ran out of file descriptors */
+#define ACCEPT_PAUSE_USEC (100 * 1000)
+
+enum chan_state {
+	CS_SOCKS,
+	CS_QUEUED,
+	CS_OPENING,
+	CS_OPEN,
+	CS_FAILED,
+};
 
 
 struct chan_sock {
 	ssh_channel channel;
+	struct gw_session *sess;
+	struct gw_session *spill_from;
 	int sock_fd;
+	int state;
+	uint32_t events;
+	uint64_t open_start;
+	uint64_t queued_at;
+	uint32_t rd_size;
+	uint32_t chan_rd_size;
+	uint64_t flush_at;
+	uint64_t rx_pass;
+	bool coalescing;
+	bool abandoned;
+	bool pooled;
+	bool probe;
+	bool ready;
+	bool closing;
+	bool chan_eof;
+	bool rd_blocked;
+	bool throttled;
+	struct buf_queue outq;
+	struct buf_queue inq;
+	struct socks_state *socks;
+	char *dest_host;
+	uint32_t dest_port;
+	struct backend *be;
+	uint32_t src_hash;
+	int be_tries;
+	uint64_t accepted_at;
+	bool replied;
+	struct chan_sock *next, *prev;
+	struct chan_sock *ready_next, *ready_prev;
+	struct chan_sock *co_next, *co_prev;
+	struct chan_sock *open_next, *open_prev;
 	struct static_port_map *parent;
 };
 
@@ -16,19 +152,63 @@ struct static_port_map {
 	uint32_t local_port;
 	char *remote_host;
 	uint32_t remote_port;
-	struct chan_sock **ch;
+	struct backend **be;
+	int n_be;
+	int n_down;
+	int be_next;
+	bool dynamic;
+	struct map_opts opts;
+	struct chan_sock *ch;
 	int n_channels;
+	bool paused;
+	bool draining;
+	uint64_t resume_at;
+	struct cs_list pool;
+	int pool_pending;
+	uint64_t pool_retry;
+	bool compress;
+	struct comp_sample *sample;
+	double entropy;
+	struct metrics_slot *metrics;
 	struct gw_host *parent;
 };
 
-void add_map_to_gw(struct gw_host *gw, uint32_t local_port,
-				   char *host, uint32_t remote_port);
+struct static_port_map *add_map_to_gw(struct gw_host *gw, uint32_t local_port,
+									  const struct backend *be, int n_be,
+									  const struct map_opts *opts);
+bool open_map_listener(struct static_port_map *pm);
+void close_map_listener(struct static_port_map *pm);
+void retry_map_listener(struct static_port_map *pm);
+void drain_map(struct static_port_map *pm);
+void update_map(struct static_port_map *pm, const struct backend *be, int n_be,
+				const struct map_opts *opts);
+void use_backend(struct chan_sock *cs, struct backend *be);
+void drop_backend(struct chan_sock *cs);
+void backend_opened(struct chan_sock *cs);
+void backend_failed(struct chan_sock *cs);
+bool other_backend_up(struct static_port_map *pm, struct backend *be);
+struct chan_sock *new_chan_sock(struct static_port_map *pm,
+							   struct gw_session *sess);
+void attach_client(struct chan_sock *cs, int sock_fd);
 struct chan_sock *
 add_channel_to_map(struct static_port_map *pm,
-				   ssh_channel channel,
+				   struct gw_session *sess,
 				   int sock_fd);
+int move_channel_to_session(struct chan_sock *cs, struct gw_session *sess);
 int connect_forward_channel(struct chan_sock *cs);
 void remove_channel_from_map(struct chan_sock *cs);
+void remove_pooled_channel(struct chan_sock *cs);
+struct chan_sock *get_cs_for_channel(struct gw_host *gw, ssh_channel ch);
+void mark_channel_ready(struct chan_sock *cs);
+void unmark_channel_ready(struct chan_sock *cs);
+void start_coalescing(struct chan_sock *cs, uint64_t flush_at);
+void stop_coalescing(struct chan_sock *cs);
+void update_chan_events(struct chan_sock *cs);
+void append_cs_list(struct cs_list *l, struct chan_sock *cs);
+void remove_cs_list(struct cs_list *l, struct chan_sock *cs);
+void free_channel(struct chan_sock *cs);
+void release_channel(struct chan_sock *cs);
 void remove_map_from_gw(struct static_port_map *map);
+void sample_map_traffic(struct static_port_map *pm, const char *data, size_t len);
 
 #endif
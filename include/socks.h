@@ -0,0 +1,33 @@
+#ifndef _SOCKS_H__
+#define _SOCKS_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Room for the largest greeting + request we accept (SOCKS4a with a user id
+ * and a hostname, or a SOCKS5 greeting followed by a domain-name request) */
+#define SOCKS_BUF_SIZE 640
+/* SOCKS5 method selection and request reply, when both go out at once */
+#define SOCKS_REPLY_MAX 12
+
+enum socks_result {
+	SOCKS_MORE,
+	SOCKS_DONE,
+	SOCKS_FAIL,
+};
+
+struct socks_state {
+	int phase;
+	int version;
+	size_t len;
+	size_t used;
+	uint32_t port;
+	char host[256];
+	unsigned char buf[SOCKS_BUF_SIZE];
+};
+
+int socks_input(struct socks_state *ss, char *reply, size_t *reply_len);
+void socks_result(struct socks_state *ss, bool ok, char *reply, size_t *reply_len);
+
+#endif
@@ -4,9 +4,16 @@
 #include <libssh/libssh.h>
 #include "autotun.h"
 
-void connect_ssh_session();
-void authenticate_ssh_session(ssh_session session, const char *key);
-void end_ssh_session(ssh_session session);
+void add_gw_member(struct gw_host *gw, const char *host);
+struct gw_session *add_gw_session(struct gw_host *gw, struct gw_member *m,
+								  bool compressed);
+int continue_gw_session(struct gw_host *gw, struct gw_session *s);
+void remove_gw_session(struct gw_host *gw, struct gw_session *s);
+int count_gw_sessions(struct gw_host *gw, bool compressed);
+int count_member_sessions(struct gw_host *gw, struct gw_member *m,
+						  bool compressed);
+bool can_add_gw_session(struct gw_host *gw, struct gw_member *m,
+						bool compressed);
 
 
 #endif
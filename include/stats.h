@@ -0,0 +1,15 @@
+#ifndef _STATS_H__
+#define _STATS_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <signal.h>
+
+struct gw_host;
+
+void log_gw_stats(struct gw_host *gw);
+
+extern volatile sig_atomic_t dump_stats;
+extern volatile sig_atomic_t stats_requests;
+
+#endif
@@ -3,6 +3,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 
 enum error_exit_codes {
 	NO_ERROR,
@@ -15,12 +16,16 @@ enum error_exit_codes {
 };
 
 void log_msg(const char *fmt, ...);
+void log_error(const char *fmt, ...);
 void log_exit(int code, const char *fmt, ...) __attribute__((noreturn));
 void log_exit_perror(int code, const char *fmt, ...) __attribute__((noreturn));
 void *safemalloc(size_t size, const char *fail);
 void saferealloc(void **p, size_t new_size, const char *fail);
 char *safestrdup(const char *str, const char *fail);
-void debug(const char *fmt, ...);
+void debug_msg(const char *fmt, ...);
+void log_start_async(void);
+void log_stop_async(void);
+uint64_t monotonic_usec(void);
 
 
 struct fd_map {
@@ -35,10 +40,37 @@ void remove_fdmap(struct fd_map *m, int idx);
 void del_fdmap(struct fd_map *fd);
 
 
+struct ptr_map_ent {
+	const void *key;
+	void *val;
+};
+
+struct ptr_map {
+	size_t size;
+	size_t used;
+	struct ptr_map_ent *ent;
+};
+
+struct ptr_map *new_ptrmap(void);
+void add_ptrmap(struct ptr_map *m, const void *key, void *val);
+void *get_ptrmap(struct ptr_map *m, const void *key);
+void remove_ptrmap(struct ptr_map *m, const void *key);
+void del_ptrmap(struct ptr_map *m);
+
+
 extern int _debug;
 extern char *prog_name;
 extern int _verbose;
 extern FILE *debug_stream;
 
+/* The -d check is inlined so a quiet build pays a test, not a call.  Built
+ * with NO_DEBUG_LOG the calls go away entirely, the arguments are still
+ * type-checked. */
+#ifdef NO_DEBUG_LOG
+#define debug(...) do { if(0) debug_msg(__VA_ARGS__); } while(0)
+#else
+#define debug(...) do { if(_debug) debug_msg(__VA_ARGS__); } while(0)
+#endif
+
 
 #endif /* _UTIL_H__ */
@@ -0,0 +1,35 @@
+#ifndef _WORKER_H__
+#define _WORKER_H__
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "autotun.h"
+#include "iniread.h"
+
+/* How often workers compare loads, and the channel imbalance worth fixing */
+#define REBALANCE_USEC (1000 * 1000)
+#define REBALANCE_MIN_DIFF 32
+
+struct worker {
+	int idx;
+	pthread_t tid;
+	bool running;
+	struct event_loop *ev;
+	struct fd_map *gw_fdmap;
+	struct gw_host **gw;
+	int n_gw;
+	struct gw_host **inbox;
+	int n_inbox;
+	int wake_fd[2];
+	int load;
+	uint64_t pass;
+	uint64_t next_balance;
+};
+
+int run_workers(struct ini_section *sec, int n);
+
+extern int n_workers;
+
+#endif
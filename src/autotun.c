@@ -1,6 +1,8 @@
 #include "autotun.h"
+#include "config.h"
 #include "port_map.h"
 #include "ssh.h"
+#include "stats.h"
 
 
 static void end_main_loop_handler(int signum)
@@ -23,10 +25,22 @@ static void end_main_loop_handler(int signum)
 		hard_shutdown = true;
 }
 
+static void stats_signal_handler(int signum)
+{
+	dump_stats = true;
+	/* Gateway threads read it while the handler may run on any thread */
+	__atomic_add_fetch(&stats_requests, 1, __ATOMIC_RELAXED);
+}
+
+static void reload_signal_handler(int signum)
+{
+	reload_config = true;
+}
+
 /* Setup signal handler */
 void setup_signals_for_child(void)
 {
-    struct sigaction sigterm_action, sighup_action;
+    struct sigaction sigterm_action, sighup_action, sigusr2_action;
     sigset_t self;
 
     sigemptyset(&self);
@@ -36,16 +50,21 @@ void setup_signals_for_child(void)
     sigterm_action.sa_mask = self;
     sigterm_action.sa_flags = 0;
 
-	/* TODO: handle re-entry into main loop on reconfig */
+	/* The loops pick the new config up between passes */
     sigemptyset(&self);
     sigaddset(&self, SIGHUP);
-    sighup_action.sa_handler = end_main_loop_handler;
+    sighup_action.sa_handler = reload_signal_handler;
     sighup_action.sa_mask = self;
     sighup_action.sa_flags = 0;
 
+    sigemptyset(&sigusr2_action.sa_mask);
+    sigusr2_action.sa_handler = stats_signal_handler;
+    sigusr2_action.sa_flags = 0;
+
     sigaction(SIGINT, &sigterm_action, NULL);
     sigaction(SIGTERM, &sigterm_action, NULL);
 	sigaction(SIGHUP, &sighup_action, NULL);
+	sigaction(SIGUSR2, &sigusr2_action, NULL);
 
 }
 
@@ -62,27 +81,86 @@ struct gw_host *create_gw(const char *hostname)
 	gw->pm = safemalloc(sizeof(struct static_port_map *), "gw_host pm array");
 	gw->listen_fdmap = new_fdmap();
 	gw->chan_sock_fdmap = new_fdmap();
+	gw->sess_fdmap = new_fdmap();
+	gw->sess = NULL;
+	gw->n_sessions = 0;
+	gw->min_sessions = 1;
+	gw->max_sessions = 1;
+	gw->chan_map = new_ptrmap();
+	gw->ready = NULL;
+	gw->coalescing = NULL;
+	gw->closing = NULL;
+	gw->n_closing = 0;
+	gw->max_opening = MAX_PENDING_OPENS;
+	gw->ev = new_event_loop(EVENT_BATCH);
 	gw->auth = NULL;
+	gw->seed = (unsigned int)(monotonic_usec() ^ getpid() ^ (uintptr_t)gw);
+	gw->hold_usec = HOLD_USEC_DEFAULT;
+	gw->hold_max = HOLD_MAX_DEFAULT;
+	gw->keepalive_usec = KEEPALIVE_USEC_DEFAULT;
+	gw->keepalive_max = KEEPALIVE_MAX_DEFAULT;
 	return gw;
 }
 
 void destroy_gw(struct gw_host *gw)
 {
-	ssh_blocking_flush(gw->session, 10);
+	int i;
+
+	for(i = 0; i < gw->n_sessions; i++)
+		if(gw->sess[i]->state == SESS_UP)
+			ssh_blocking_flush(gw->sess[i]->session, 10);
 
 	while(gw->n_maps)
 		remove_map_from_gw(gw->pm[0]);
 
-	ssh_disconnect(gw->session);
+	while(gw->n_sessions > 0)
+		remove_gw_session(gw, gw->sess[0]);
+	for(i = 0; i < gw->n_members; i++)	{
+		ssh_free(gw->members[i]->session);
+		free(gw->members[i]->host);
+		free(gw->members[i]);
+	}
+	free(gw->members);
 	ssh_free(gw->session);
+	free(gw->sess);
+	if(gw->auth_key != NULL)
+		ssh_key_free(gw->auth_key);
+	free(gw->auth);
 
+	if(gw->metrics != NULL)
+		metrics_slot_free(gw->metrics, NULL);
+
+	del_fdmap(gw->sess_fdmap);
 	del_fdmap(gw->listen_fdmap);
 	del_fdmap(gw->chan_sock_fdmap);
+	del_ptrmap(gw->chan_map);
+	del_event_loop(gw->ev);
 	free(gw->name);
 	free(gw->pm);
 	free(gw);
 }
 
+/**
+ * Re-read the config on SIGHUP and apply it to this gateway process
+ *
+ * The parent has checked the file before passing the signal on and left
+ * the checked copy for us, so it's only parsed here; whatever happens to
+ * the file itself meanwhile doesn't matter.  See reload_gw() for what
+ * changes.
+ *
+ * @gw		the process's gateway
+ */
+void reload_gateway(struct gw_host *gw)
+{
+	struct ini_section *sec;
+	struct ini_file *ini;
+
+	log_msg("Reloading config for %s", gw->name);
+	if((ini = read_checked_configfile(cfgfile, &sec)) == NULL)
+		return;
+	reload_gw(gw, sec);
+	ini_free_data(ini);
+}
 
 int run_gateway(struct gw_host *gw)
 {
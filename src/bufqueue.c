@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "util.h"
+#include "bufqueue.h"
+
+/*
+ * A byte queue made of a singly-linked list of chunks, used to hold data that
+ * could not be written to a non-blocking socket yet.  Appends fill the tail
+ * chunk before allocating a new one, so a stream of small writes doesn't
+ * turn into a stream of small allocations.
+ */
+
+void init_bufq(struct buf_queue *q)
+{
+	q->head = q->tail = NULL;
+	q->bytes = 0;
+}
+
+void append_bufq(struct buf_queue *q, const void *data, size_t len)
+{
+	struct buf_chunk *c = q->tail;
+	size_t n;
+
+	q->bytes += len;
+
+	if(c != NULL && c->len < c->size)	{
+		n = (len < c->size - c->len) ? len : c->size - c->len;
+		memcpy(c->data + c->len, data, n);
+		c->len += n;
+		data = (const char *)data + n;
+		len -= n;
+	}
+
+	if(len == 0)
+		return;
+
+	n = (len > BUFQ_CHUNK_SIZE) ? len : BUFQ_CHUNK_SIZE;
+	c = safemalloc(sizeof(struct buf_chunk) + n, "bufq chunk");
+	c->size = n;
+	c->len = len;
+	c->off = 0;
+	c->next = NULL;
+	memcpy(c->data, data, len);
+
+	if(q->tail != NULL)
+		q->tail->next = c;
+	else
+		q->head = c;
+	q->tail = c;
+}
+
+/* Drop @len bytes from the front of the queue */
+void consume_bufq(struct buf_queue *q, size_t len)
+{
+	struct buf_chunk *c;
+
+	while(len > 0 && (c = q->head) != NULL)	{
+		size_t avail = c->len - c->off;
+
+		if(len < avail)	{
+			c->off += len;
+			q->bytes -= len;
+			return;
+		}
+		len -= avail;
+		q->bytes -= avail;
+		q->head = c->next;
+		if(q->head == NULL)
+			q->tail = NULL;
+		free(c);
+	}
+}
+
+/**
+ * Write as much of the queue as the non-blocking socket @fd will take
+ *
+ * Up to BUFQ_IOV_MAX chunks go out in each sendmsg() (a writev() that
+ * can't raise SIGPIPE), so a deep queue costs few syscalls.
+ *
+ * @q		Queue to flush
+ * @fd		Socket to send on
+ * @return	Bytes written (0 if the socket is full), -1 on a real error
+ */
+ssize_t flush_bufq(struct buf_queue *q, int fd)
+{
+	struct iovec iov[BUFQ_IOV_MAX];
+	struct msghdr msg;
+	ssize_t total = 0, rc;
+	size_t want;
+	struct buf_chunk *c;
+	int n;
+
+	while(q->head != NULL)	{
+		want = 0;
+		for(n = 0, c = q->head; c != NULL && n < BUFQ_IOV_MAX; c = c->next, n++)	{
+			iov[n].iov_base = c->data + c->off;
+			iov[n].iov_len = c->len - c->off;
+			want += iov[n].iov_len;
+		}
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = n;
+		rc = sendmsg(fd, &msg, MSG_NOSIGNAL);
+		if(rc < 0)	{
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+		consume_bufq(q, rc);
+		total += rc;
+		if(rc < want)
+			break;
+	}
+	return total;
+}
+
+void clear_bufq(struct buf_queue *q)
+{
+	consume_bufq(q, q->bytes);
+}
@@ -0,0 +1,198 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef HAVE_OPENSSL
+#include <openssl/evp.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#elif defined(__aarch64__) && defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+#include "util.h"
+#include "cipher.h"
+
+/* Ciphers we know how to rank, by MB/s once measured (or guessed) */
+struct cipher_rank {
+	const char *ssh_name;
+	double mbps;
+};
+
+static struct cipher_rank ciphers[] = {
+	{ "aes128-gcm@openssh.com", 0 },
+	{ "aes256-gcm@openssh.com", 0 },
+	{ "chacha20-poly1305@openssh.com", 0 },
+	{ "aes128-ctr", 0 },
+	{ "aes256-ctr", 0 },
+};
+#define N_CIPHERS (sizeof(ciphers) / sizeof(ciphers[0]))
+
+/* Worked out once, every gateway (and forked child) reuses it */
+static char *cipher_prefs = NULL;
+
+#ifdef HAVE_OPENSSL
+
+static const EVP_CIPHER *evp_for(const char *ssh_name)
+{
+	if(strcmp(ssh_name, "aes128-gcm@openssh.com") == 0)
+		return EVP_aes_128_gcm();
+	if(strcmp(ssh_name, "aes256-gcm@openssh.com") == 0)
+		return EVP_aes_256_gcm();
+	if(strcmp(ssh_name, "chacha20-poly1305@openssh.com") == 0)
+		return EVP_chacha20_poly1305();
+	if(strcmp(ssh_name, "aes128-ctr") == 0)
+		return EVP_aes_128_ctr();
+	return EVP_aes_256_ctr();
+}
+
+/**
+ * Encrypt a buffer over and over for CIPHER_BENCH_USEC
+ *
+ * @c		cipher to run
+ * @return	Throughput in MB/s, 0 if the cipher isn't usable here
+ */
+static double bench_cipher(const EVP_CIPHER *c)
+{
+	static unsigned char in[CIPHER_BENCH_BUF], out[CIPHER_BENCH_BUF + 32];
+	unsigned char key[32] = {0}, iv[16] = {0};
+	EVP_CIPHER_CTX *ctx;
+	uint64_t start, now, bytes = 0;
+	int len;
+
+	if((ctx = EVP_CIPHER_CTX_new()) == NULL)
+		return 0;
+	if(EVP_EncryptInit_ex(ctx, c, NULL, key, iv) != 1)	{
+		EVP_CIPHER_CTX_free(ctx);
+		return 0;
+	}
+
+	start = now = monotonic_usec();
+	while(now - start < CIPHER_BENCH_USEC)	{
+		if(EVP_EncryptUpdate(ctx, out, &len, in, sizeof(in)) != 1)	{
+			EVP_CIPHER_CTX_free(ctx);
+			return 0;
+		}
+		bytes += len;
+		now = monotonic_usec();
+	}
+	EVP_CIPHER_CTX_free(ctx);
+	return (double)bytes / (now - start);
+}
+
+/* Throughput of SHA-256, the MAC the non-AEAD ciphers need on top */
+static double bench_sha256(void)
+{
+	static unsigned char in[CIPHER_BENCH_BUF];
+	EVP_MD_CTX *ctx;
+	uint64_t start, now, bytes = 0;
+
+	if((ctx = EVP_MD_CTX_new()) == NULL)
+		return 0;
+	EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+
+	start = now = monotonic_usec();
+	while(now - start < CIPHER_BENCH_USEC)	{
+		EVP_DigestUpdate(ctx, in, sizeof(in));
+		bytes += sizeof(in);
+		now = monotonic_usec();
+	}
+	EVP_MD_CTX_free(ctx);
+	return (double)bytes / (now - start);
+}
+
+static void rank_ciphers(void)
+{
+	double mac = bench_sha256();
+	size_t i;
+
+	for(i = 0; i < N_CIPHERS; i++)	{
+		ciphers[i].mbps = bench_cipher(evp_for(ciphers[i].ssh_name));
+		/* Counter mode has to run an HMAC over the data as well */
+		if(strstr(ciphers[i].ssh_name, "-ctr") != NULL && ciphers[i].mbps > 0)
+			ciphers[i].mbps = (mac > 0) ?
+				1 / (1 / ciphers[i].mbps + 1 / mac) : 0;
+		debug("Cipher %s: %.0f MB/s", ciphers[i].ssh_name, ciphers[i].mbps);
+	}
+}
+
+#else
+
+/* Without a crypto library to time, AES wins only with hardware support */
+static bool have_aes_hw(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	unsigned int a, b, c, d;
+
+	return __get_cpuid(1, &a, &b, &c, &d) && (c & bit_AES);
+#elif defined(__aarch64__) && defined(__linux__)
+	return (getauxval(AT_HWCAP) & HWCAP_AES) != 0;
+#else
+	return false;
+#endif
+}
+
+static void rank_ciphers(void)
+{
+	bool aes = have_aes_hw();
+	size_t i;
+
+	/* Rough relative speeds, only the order matters */
+	for(i = 0; i < N_CIPHERS; i++)	{
+		if(strstr(ciphers[i].ssh_name, "chacha20") != NULL)
+			ciphers[i].mbps = 4;
+		else if(strstr(ciphers[i].ssh_name, "gcm") != NULL)
+			ciphers[i].mbps = aes ? 10 : 1;
+		else
+			ciphers[i].mbps = aes ? 6 : 2;
+		if(strstr(ciphers[i].ssh_name, "256") != NULL)
+			ciphers[i].mbps *= 0.8;
+	}
+	debug("No benchmark available, AES hardware support %s",
+		  aes ? "found" : "not found");
+}
+
+#endif
+
+static int by_speed(const void *a, const void *b)
+{
+	const struct cipher_rank *x = a, *y = b;
+
+	return (x->mbps < y->mbps) - (x->mbps > y->mbps);
+}
+
+/**
+ * Cipher preference list with the fastest on this host first
+ *
+ * libssh picks the first of our ciphers the server also offers, so ranking
+ * them by local speed gets the fastest the server allows.  Measured with
+ * OpenSSL when built with it, otherwise guessed from the cpu's AES support.
+ * The result is cached, call this before forking to only measure once.
+ *
+ * @return	Comma separated cipher list for SSH_OPTIONS_CIPHERS_*
+ */
+const char *fastest_ciphers(void)
+{
+	size_t i, len = 0;
+
+	if(cipher_prefs != NULL)
+		return cipher_prefs;
+
+	rank_ciphers();
+	qsort(ciphers, N_CIPHERS, sizeof(ciphers[0]), by_speed);
+
+	for(i = 0; i < N_CIPHERS; i++)
+		len += strlen(ciphers[i].ssh_name) + 1;
+	cipher_prefs = safemalloc(len, "cipher preference list");
+	for(i = 0; i < N_CIPHERS; i++)	{
+		if(i > 0)
+			strcat(cipher_prefs, ",");
+		strcat(cipher_prefs, ciphers[i].ssh_name);
+	}
+
+	log_msg("Cipher preference: %s", cipher_prefs);
+	return cipher_prefs;
+}
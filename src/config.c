@@ -5,24 +5,80 @@
 #include <assert.h>
 #include <ctype.h>
 #include <strings.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/types.h>
+#include <sys/wait.h>
 
 #include "autotun.h"
 #include "config.h"
 #include "port_map.h"
+#include "ssh.h"
 #include "util.h"
+#include "worker.h"
+#include "cipher.h"
 
+/* How long the check of a reloaded config may run, 'ciphers = auto' times
+ * the ciphers in it */
+#define CONFIG_CHECK_USEC (10 * 1000 * 1000)
+
+extern char **environ;
+
+/* Private directory holding the last config that passed the check, for the
+ * gateway processes to reload from.  Made by the main process at startup,
+ * it's the only one to remove it. */
+static char *snapshot_dir = NULL;
+static pid_t snapshot_owner;
+
+/* Maps added by a reload wait for a port that's still taken, at startup
+ * that is an error */
+static int n_reads = 0;
+
+char *stats_socket = NULL;
 
 static void process_global_config(struct ini_section *sec)
 {
 	char *p;
+	int err, n, fd;
 
+	/* Reopened on a reload, so the log can be rotated.  Other threads (the
+	 * workers, the log flush thread) keep writing to the descriptor, so the
+	 * new file is put in its place with dup2() and it's never closed. */
 	p = ini_get_section_value(sec, "log_file");
-	if(p != NULL)	{
+	if(p != NULL && debug_stream != stderr)	{
+		if((fd = open(p, O_WRONLY | O_APPEND | O_CREAT, 0666)) < 0)
+			log_exit_perror(-1, "Error reopening logfile '%s'", p);
+		if(dup2(fd, fileno(debug_stream)) < 0)
+			log_exit_perror(-1, "Error reopening logfile '%s'", p);
+		close(fd);
+	} else if(p != NULL)	{
 		if((debug_stream = fopen(p, "a")) == NULL)	{
 			debug_stream = stderr;
 			log_exit_perror(-1, "Error opening logfile '%s'", p);
 		}
 	}
+
+	/* Bound once at startup, a reload can't move it */
+	p = ini_get_section_value(sec, "stats_socket");
+	if(p != NULL && stats_socket == NULL)
+		stats_socket = safestrdup(p, "stats socket path");
+
+	/* Threads instead of a process per gateway, one per cpu for 'auto' */
+	if((p = ini_get_section_value(sec, "workers")) != NULL)	{
+		if(strcasecmp(p, "auto") == 0)	{
+			if((n_workers = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+				n_workers = 1;
+		} else {
+			n = ini_get_section_int(sec, "workers", &err);
+			if(err != INI_OK || n < 0)
+				log_exit(CONFIG_ERROR, "Error: invalid value for workers: %s", p);
+			n_workers = n;
+		}
+	}
 }
 
 /**
@@ -35,14 +91,16 @@ static void process_global_config(struct ini_section *sec)
  * @first_sec	Place to put pointer to first section corresponding to a gw
  * @returns		A pointer to the full ini-file structure
  */
-struct ini_file *
-read_configfile(const char *filename, struct ini_section **first_sec)
+static struct ini_file *
+read_config_as(const char *path, const char *filename,
+			   struct ini_section **first_sec)
 {
 	struct ini_file *ini;
 	int rv;
 
 	debug("Reading config file: '%s'", filename);
-	switch(rv = ini_read_file(filename, &ini))	{
+	n_reads++;
+	switch(rv = ini_read_file(path, &ini))	{
 		case INI_OK:
 			break;
 		default:
@@ -66,6 +124,12 @@ read_configfile(const char *filename, struct ini_section **first_sec)
 	return ini;
 }
 
+struct ini_file *
+read_configfile(const char *filename, struct ini_section **first_sec)
+{
+	return read_config_as(filename, filename, first_sec);
+}
+
 static uint32_t get_port(char *str)
 {
 	unsigned long int n;
@@ -90,18 +154,290 @@ static inline bool is_port(char *str)
 	return true;
 }
 
-static void parse_host_line(char *str, char **host, uint32_t *port)
+static int get_nonneg_int(const char *key, const char *str)
 {
+	long int n;
 	char *p;
 
-	if((p = strtok(str, ":")) == NULL)
+	errno = 0;
+	n = strtol(str, &p, 10);
+	if(errno != 0 || *p != '\0' || p == str || n < 0 || n > INT32_MAX)
+		log_exit(CONFIG_ERROR, "Error: invalid value for %s: %s", key, str);
+
+	return (int)n;
+}
+
+static bool get_bool(const char *key, const char *str)
+{
+	if(strcasecmp(str, "true") == 0 || strcasecmp(str, "yes") == 0 ||
+	   strcasecmp(str, "on") == 0 || strcmp(str, "1") == 0)
+		return true;
+	if(strcasecmp(str, "false") == 0 || strcasecmp(str, "no") == 0 ||
+	   strcasecmp(str, "off") == 0 || strcmp(str, "0") == 0)
+		return false;
+	log_exit(CONFIG_ERROR, "Error: invalid boolean for %s: %s", key, str);
+}
+
+enum map_opt_type {
+	MOPT_INT,
+	MOPT_BOOL,
+	MOPT_COMP,
+	MOPT_BALANCE,
+};
+
+/* Options that can be given per-map after the host:port, or in the section
+ * to set the default for every map in it */
+static const struct map_opt_def {
+	const char *name;
+	enum map_opt_type type;
+	size_t offset;
+} map_opt_defs[] = {
+	{ "pool_size",	MOPT_INT,	offsetof(struct map_opts, pool_size) },
+	{ "shards",		MOPT_INT,	offsetof(struct map_opts, shards) },
+	{ "max_conns",	MOPT_INT,	offsetof(struct map_opts, max_conns) },
+	{ "max_read",	MOPT_INT,	offsetof(struct map_opts, max_read) },
+	{ "coalesce_usec", MOPT_INT, offsetof(struct map_opts, coalesce_usec) },
+	{ "coalesce_bytes", MOPT_INT, offsetof(struct map_opts, coalesce_bytes) },
+	{ "compression", MOPT_COMP,	offsetof(struct map_opts, compression) },
+	{ "balance",	MOPT_BALANCE, offsetof(struct map_opts, balance) },
+	{ "backlog",	MOPT_INT,	offsetof(struct map_opts, sock.backlog) },
+	{ "defer_accept", MOPT_INT,	offsetof(struct map_opts, sock.defer_accept) },
+	{ "nodelay",	MOPT_BOOL,	offsetof(struct map_opts, sock.nodelay) },
+	{ "rcvbuf",		MOPT_INT,	offsetof(struct map_opts, sock.rcvbuf) },
+	{ "sndbuf",		MOPT_INT,	offsetof(struct map_opts, sock.sndbuf) },
+	{ "notsent_lowat", MOPT_INT, offsetof(struct map_opts, sock.notsent_lowat) },
+	{ "fastopen",	MOPT_INT,	offsetof(struct map_opts, sock.fastopen) },
+	{ "keepalive",	MOPT_INT,	offsetof(struct map_opts, sock.keepalive) },
+	{ NULL,			0,			0 },
+};
+
+static void set_map_opt(struct map_opts *mo, const char *key, const char *val)
+{
+	const struct map_opt_def *d;
+
+	for(d = map_opt_defs; d->name != NULL; d++)
+		if(strcmp(d->name, key) == 0)
+			break;
+
+	if(d->name == NULL)
+		log_exit(CONFIG_ERROR, "Error: unknown map option '%s'", key);
+
+	switch(d->type)	{
+		case MOPT_INT:
+			*(int *)((char *)mo + d->offset) = get_nonneg_int(key, val);
+			break;
+		case MOPT_BOOL:
+			*(bool *)((char *)mo + d->offset) = get_bool(key, val);
+			break;
+		case MOPT_COMP:
+			if(strcasecmp(val, "auto") == 0)
+				*(int *)((char *)mo + d->offset) = COMP_AUTO;
+			else
+				*(int *)((char *)mo + d->offset) =
+					get_bool(key, val) ? COMP_ON : COMP_OFF;
+			break;
+		case MOPT_BALANCE:
+			if(strcasecmp(val, "leastconn") == 0)
+				*(int *)((char *)mo + d->offset) = BACKEND_LEASTCONN;
+			else if(strcasecmp(val, "rr") == 0)
+				*(int *)((char *)mo + d->offset) = BACKEND_RR;
+			else if(strcasecmp(val, "source") == 0)
+				*(int *)((char *)mo + d->offset) = BACKEND_SOURCE;
+			else
+				log_exit(CONFIG_ERROR, "Error: invalid value for %s: %s",
+						 key, val);
+			break;
+	}
+}
+
+/* Section-wide defaults for the per-map options */
+static void read_map_defaults(struct ini_section *sec, struct map_opts *mo)
+{
+	const struct map_opt_def *d;
+	char *val;
+
+	memset(mo, 0, sizeof(*mo));
+	for(d = map_opt_defs; d->name != NULL; d++)
+		if((val = ini_get_section_value(sec, d->name)) != NULL)
+			set_map_opt(mo, d->name, val);
+}
+
+/* Any whitespace separated key=value options following the host:port */
+static void parse_map_opts(char *str, struct map_opts *mo)
+{
+	char *tok, *val, *save;
+
+	for(tok = strtok_r(str, " \t", &save); tok != NULL;
+		tok = strtok_r(NULL, " \t", &save))	{
+		if((val = strchr(tok, '=')) == NULL)
+			log_exit(CONFIG_ERROR, "Error: map option needs a value: %s", tok);
+		*val++ = '\0';
+		set_map_opt(mo, tok, val);
+	}
+}
+
+/**
+ * Parse a map line, host:port[,host:port...] [option=value ...]
+ *
+ * A host part of just "socks" makes it a dynamic (SOCKS) map, where each
+ * client names its own destination.  Several comma separated destinations
+ * are backends the map balances its connections over.
+ *
+ * @str		The value of the map line, modified in place
+ * @be		Set to a malloc'd array of the destinations, NULL for SOCKS
+ * @n_be	Set to the number of destinations, 0 for a SOCKS map
+ * @mo		Options to update from the rest of the line
+ */
+static void parse_host_line(char *str, struct backend **be, int *n_be,
+							struct map_opts *mo)
+{
+	char *p, *dest, *save, *hsave;
+
+	if((p = strpbrk(str, " \t")) != NULL)	{
+		*p++ = '\0';
+		parse_map_opts(p, mo);
+	}
+
+	*be = NULL;
+	*n_be = 0;
+	if(strcmp(str, "socks") == 0)
+		return;
+
+	for(dest = strtok_r(str, ",", &save); dest != NULL;
+		dest = strtok_r(NULL, ",", &save))	{
+		struct backend *b;
+
+		saferealloc((void **)be, (*n_be + 1) * sizeof(struct backend),
+					"map backends");
+		b = &(*be)[(*n_be)++];
+		memset(b, 0, sizeof(*b));
+
+		if((p = strtok_r(dest, ":", &hsave)) == NULL)
+			log_exit(CONFIG_ERROR, "Error: invalid host line found: %s", dest);
+		b->host = safestrdup(p, "map host");
+		if((p = strtok_r(NULL, ":", &hsave)) == NULL)
+			log_exit(CONFIG_ERROR, "Error: port not found: %s", dest);
+		b->port = get_port(p);
+		if(strtok_r(NULL, ":", &hsave) != NULL)
+			log_exit(CONFIG_ERROR, "Error: superfluous data found in host line: %s",
+					 dest);
+	}
+	if(*n_be == 0)
 		log_exit(CONFIG_ERROR, "Error: invalid host line found: %s", str);
-	*host = p;
-	if((p = strtok(NULL, ":")) == NULL)
-		log_exit(CONFIG_ERROR, "Error: port not found: %s", str);
-	*port = get_port(p);
-	if(strtok(NULL, ":") != NULL)
-		log_exit(CONFIG_ERROR, "Error: superfluous data found in host line: %s", str);
+}
+
+static void free_backends(struct backend *be, int n_be)
+{
+	int i;
+
+	for(i = 0; i < n_be; i++)
+		free(be[i].host);
+	free(be);
+}
+
+/* A comma separated algorithm list for both directions, libssh drops any
+ * names it doesn't support and fails only if none are left */
+static void set_algo_option(struct gw_host *gw, const char *key,
+							enum ssh_options_e c_s, enum ssh_options_e s_c,
+							const char *list)
+{
+	if(ssh_options_set(gw->session, c_s, list) != SSH_OK ||
+	   (s_c != c_s && ssh_options_set(gw->session, s_c, list) != SSH_OK))
+		log_exit(CONFIG_ERROR, "Error: no usable %s in '%s': %s", key, list,
+				 ssh_get_error(gw->session));
+	debug("%s for %s: %s", key, gw->name, list);
+}
+
+/**
+ * Set the ciphers, MACs and key exchange methods the section asks for
+ *
+ * Each is a comma separated list in order of preference, unset leaves the
+ * libssh default.  "ciphers = auto" puts the fastest cipher on this host
+ * first, see fastest_ciphers().
+ *
+ * @sec	The ini-section to read
+ * @gw	gateway whose template session gets the settings
+ */
+static void set_algorithms(struct ini_section *sec, struct gw_host *gw)
+{
+	char *str;
+
+	if((str = ini_get_section_value(sec, "ciphers")) != NULL)	{
+		if(strcasecmp(str, "auto") == 0)
+			str = (char *)fastest_ciphers();
+		set_algo_option(gw, "ciphers", SSH_OPTIONS_CIPHERS_C_S,
+						SSH_OPTIONS_CIPHERS_S_C, str);
+	}
+	if((str = ini_get_section_value(sec, "macs")) != NULL)
+		set_algo_option(gw, "macs", SSH_OPTIONS_HMAC_C_S,
+						SSH_OPTIONS_HMAC_S_C, str);
+	if((str = ini_get_section_value(sec, "kex")) != NULL)
+		set_algo_option(gw, "kex", SSH_OPTIONS_KEY_EXCHANGE,
+						SSH_OPTIONS_KEY_EXCHANGE, str);
+}
+
+/* Run the cipher benchmark once up front if any gateway wants it, so forked
+ * gateways share the result */
+void prepare_cipher_prefs(struct ini_section *sec)
+{
+	char *str;
+
+	for(; sec != NULL; sec = sec->next)	{
+		str = ini_get_section_value(sec, "ciphers");
+		if(str != NULL && strcasecmp(str, "auto") == 0)	{
+			fastest_ciphers();
+			return;
+		}
+	}
+}
+
+/**
+ * Set up the gateway hosts the section's maps go through
+ *
+ * "gateway = host1,host2..." makes a pool of them and the section name only
+ * a label, otherwise the section name is the one gateway.  New channels go
+ * to the established session with the fewest channels, or with
+ * "gateway_balance = rtt" to the one with the lowest keepalive round-trip.
+ *
+ * @sec	The ini-section to read
+ * @gw	gateway whose template session is set up already
+ */
+static void add_gw_pool(struct ini_section *sec, struct gw_host *gw)
+{
+	char *str, *list, *tok, *save;
+
+	if((str = ini_get_section_value(sec, "gateway_balance")) != NULL)	{
+		if(strcasecmp(str, "leastconn") == 0)
+			gw->balance = BALANCE_LEASTCONN;
+		else if(strcasecmp(str, "rtt") == 0)
+			gw->balance = BALANCE_RTT;
+		else
+			log_exit(CONFIG_ERROR, "Error: invalid gateway_balance: %s", str);
+	}
+
+	/* The round-trips come from the keepalive probes, on unless turned off */
+	if(gw->balance == BALANCE_RTT && gw->keepalive_usec == 0)	{
+		if(ini_get_section_value(sec, "keepalive") == NULL)
+			gw->keepalive_usec = KEEPALIVE_RTT_USEC_DEFAULT;
+		else
+			log_msg("[%s] balances on rtt with keepalive = 0, no round-trips "
+					"are measured", gw->name);
+	}
+
+	if((str = ini_get_section_value(sec, "gateway")) == NULL)	{
+		add_gw_member(gw, gw->name);
+		return;
+	}
+
+	list = safestrdup(str, "gateway list");
+	for(tok = strtok_r(list, ", \t", &save); tok != NULL;
+		tok = strtok_r(NULL, ", \t", &save))
+		add_gw_member(gw, tok);
+	free(list);
+
+	if(gw->n_members == 0)
+		log_exit(CONFIG_ERROR, "Error: empty gateway list in [%s]", sec->name);
+	debug("%s is a pool of %d gateways", gw->name, gw->n_members);
 }
 
 /**
@@ -116,8 +452,8 @@ static void create_gw_session_config(struct ini_section *sec, struct gw_host *gw
 	int ssh_verbosity = (_verbose == 0) ? SSH_LOG_NOLOG : SSH_LOG_PROTOCOL;
 	int err, off = 0, on = 1;
 	char *str;
-	bool compression = false;
-	int c_level;
+	bool process_config = false;
+	int c_level, n;
 
 	if((gw->session = ssh_new()) == NULL)
 		log_exit(CONNECTION_ERROR, "ssh_new(): Error creating ssh session");
@@ -125,22 +461,14 @@ static void create_gw_session_config(struct ini_section *sec, struct gw_host *gw
 	ssh_options_set(gw->session, SSH_OPTIONS_HOST, gw->name);
 	ssh_options_set(gw->session, SSH_OPTIONS_LOG_VERBOSITY, &ssh_verbosity);
 	ssh_options_set(gw->session, SSH_OPTIONS_SSH1, &off);
-	ssh_options_set(gw->session, SSH_OPTIONS_PROCESS_CONFIG, &compression);
+	ssh_options_set(gw->session, SSH_OPTIONS_PROCESS_CONFIG, &process_config);
 // 	ssh_options_set(gw->session, SSH_OPTIONS_SSH_DIR, ".sshold/");
 
-	/* Zero / false is default */
-	compression = ini_get_section_bool(sec, "compression", &err);
+	/* Compression is chosen per map (the section's 'compression' is the
+	 * default for its maps), each session is set up compressed or plain
+	 * when it connects */
 	c_level = ini_get_section_int(sec, "compression_level", &err);
-	if(compression)	{
-		if(c_level <= 0 || err != INI_OK)
-			c_level = 5;
-		debug("Compression enabled, level %d", c_level);
-
-		ssh_options_set(gw->session, SSH_OPTIONS_COMPRESSION, "yes");
-		ssh_options_set(gw->session, SSH_OPTIONS_COMPRESSION_LEVEL, &c_level);
-	} else if(c_level != 0 && !compression)	{
-		log_exit(CONFIG_ERROR, "Error: cannot set compression-level if compression is not set");
-	}
+	gw->comp_level = (c_level <= 0 || err != INI_OK) ? 5 : c_level;
 
 	if(!ini_get_section_bool(sec, "strict_host_key", &err) && err == INI_OK)	{
 		debug("WARNING: strict host key checking DISABLED!");
@@ -149,6 +477,8 @@ static void create_gw_session_config(struct ini_section *sec, struct gw_host *gw
 		ssh_options_set(gw->session, SSH_OPTIONS_STRICTHOSTKEYCHECK, &on);
 	}
 
+	set_algorithms(sec, gw);
+
 	if((str = ini_get_section_value(sec, "proxy_command")) != NULL)
 		ssh_options_set(gw->session, SSH_OPTIONS_PROXYCOMMAND, str);
 
@@ -160,34 +490,158 @@ static void create_gw_session_config(struct ini_section *sec, struct gw_host *gw
 	gw->local = 1;
 	if((str = ini_get_section_value(sec, "bind_local")) != NULL)
 		gw->local = strcasecmp(str, "false");
+
+	n = ini_get_section_int(sec, "max_pending_opens", &err);
+	if(err == INI_OK && n > 0)
+		gw->max_opening = n;
+
+	/* Total client connections for the gateway, maps have max_conns */
+	n = ini_get_section_int(sec, "gw_max_conns", &err);
+	if(err == INI_OK && n > 0)
+		gw->max_conns = n;
+
+	/* Sessions are connected on first use, and closed again after this many
+	 * seconds without clients */
+	n = ini_get_section_int(sec, "idle_timeout", &err);
+	if(err == INI_OK && n > 0)
+		gw->idle_usec = (uint64_t)n * 1000000;
+
+	/* Clients held while the gateway can't be reached */
+	n = ini_get_section_int(sec, "hold_timeout", &err);
+	if(err == INI_OK && n >= 0)
+		gw->hold_usec = (uint64_t)n * 1000000;
+	n = ini_get_section_int(sec, "hold_max", &err);
+	if(err == INI_OK && n >= 0)
+		gw->hold_max = n;
+
+	/* Seconds between keepalive probes (0 for none), and how many may go
+	 * unanswered before the session is taken for dead */
+	n = ini_get_section_int(sec, "keepalive", &err);
+	if(err == INI_OK && n >= 0)
+		gw->keepalive_usec = (uint64_t)n * 1000000;
+	n = ini_get_section_int(sec, "keepalive_max", &err);
+	if(err == INI_OK && n > 0)
+		gw->keepalive_max = n;
+
+	/* Sessions opened together on first use, and how many we may grow to if
+	 * the server refuses channels on the ones we have */
+	n = ini_get_section_int(sec, "sessions", &err);
+	if(err == INI_OK && n > 0)
+		gw->min_sessions = n;
+	gw->max_sessions = gw->min_sessions;
+	n = ini_get_section_int(sec, "max_sessions", &err);
+	if(err == INI_OK && n > 0)	{
+		if(n < gw->min_sessions)
+			log_exit(CONFIG_ERROR, "Error: max_sessions %d less than sessions %d",
+					 n, gw->min_sessions);
+		gw->max_sessions = n;
+	}
+
+	add_gw_pool(sec, gw);
+}
+
+/**
+ * Read one map line of the section
+ *
+ * The line is parsed from a copy so the section can be read again, once for
+ * each shard.
+ *
+ * @kvp		The map's key-value pair, local port = host:port [options]
+ * @defaults	Section defaults for the map options
+ * @lp		Set to the local port
+ * @be		Set to the destinations, free with free_backends()
+ * @n_be	Set to the number of destinations, 0 for SOCKS
+ * @mo		Set to the map's options
+ */
+static void read_map_line(struct ini_kv_pair *kvp, const struct map_opts *defaults,
+						  uint32_t *lp, struct backend **be, int *n_be,
+						  struct map_opts *mo)
+{
+	char *line = safestrdup(kvp->value, "map line copy");
+
+	*mo = *defaults;
+	*lp = get_port(kvp->key);
+	parse_host_line(line, be, n_be, mo);
+	free(line);
+}
+
+/**
+ * How many gateway instances the section needs, the most shards of any map
+ *
+ * @sec     The ini-file section to look at
+ * @return	Number of shards, at least 1
+ */
+int section_shards(struct ini_section *sec)
+{
+	struct ini_kv_pair *kvp;
+	struct map_opts defaults, mo;
+	struct backend *be;
+	uint32_t lp;
+	int n = 1, n_be;
+
+	read_map_defaults(sec, &defaults);
+	for(kvp = sec->items; kvp != NULL; kvp = kvp->next)	{
+		if(!is_port(kvp->key))
+			continue;
+		read_map_line(kvp, &defaults, &lp, &be, &n_be, &mo);
+		if(mo.shards > n)
+			n = mo.shards;
+		free_backends(be, n_be);
+	}
+	return n;
+}
+
+/* Add a map to @gw, a port that is taken is fatal unless this is a reload */
+static void start_map(struct gw_host *gw, uint32_t lp, const struct backend *be,
+					  int n_be, const struct map_opts *mo)
+{
+	struct static_port_map *pm = add_map_to_gw(gw, lp, be, n_be, mo);
+
+	if(pm->listen_fd >= 0)
+		return;
+	if(n_reads <= 1)
+		log_exit(SOCKET_ERROR, "Error: cannot listen on port %d", lp);
+	retry_map_listener(pm);
 }
 
 /**
  * Create a gw_host struct from information held in the config-file section
  *
+ * A map with shards=N is served by N gateway instances, each with its own
+ * ssh session(s) and its own listening socket on the same port, the kernel
+ * spreads the connections over them (SO_REUSEPORT).  Shard 0 has every map
+ * of the section, shard k only the maps that have more than k shards.
+ *
  * @sec     The ini-file section to parse
+ * @shard	Which shard of the section to build, 0 for the normal gateway
  * @returns A newly-created, empty gw_host struct
  */
-struct gw_host *process_section_to_gw(struct ini_section *sec)
+struct gw_host *process_section_to_gw(struct ini_section *sec, int shard)
 {
 	struct ini_kv_pair *kvp;
 	struct gw_host *gw;
+	struct map_opts defaults;
 
 	assert(sec != NULL && sec->items != NULL);
 
 	gw = create_gw(sec->name);
+	gw->shard = shard;
+	gw->metrics = metrics_slot_new(gw->name, shard, 0);
 	create_gw_session_config(sec, gw);
+	read_map_defaults(sec, &defaults);
 
 	kvp = sec->items;
 	while(kvp)	{
 		if(is_port(kvp->key))	{
-			char *host;
-			uint32_t rp, lp;
-
-			lp = get_port(kvp->key);
-			parse_host_line(kvp->value, &host, &rp);
-
-			add_map_to_gw(gw, lp, host, rp);
+			struct map_opts mo;
+			struct backend *be;
+			uint32_t lp;
+			int n_be;
+
+			read_map_line(kvp, &defaults, &lp, &be, &n_be, &mo);
+			if(shard == 0 || mo.shards > shard)
+				start_map(gw, lp, be, n_be, &mo);
+			free_backends(be, n_be);
 		}
 		kvp = kvp->next;
 	}
@@ -195,3 +649,331 @@ struct gw_host *process_section_to_gw(struct ini_section *sec)
 	return gw;
 }
 
+/**
+ * Find the gateway section called @name
+ *
+ * @sec		First gateway section of the config
+ * @name	Section (gateway host) name
+ * @return	The section, NULL if there's none by that name
+ */
+struct ini_section *find_gw_section(struct ini_section *sec, const char *name)
+{
+	for(; sec != NULL; sec = sec->next)
+		if(strcmp(sec->name, name) == 0)
+			return sec;
+	return NULL;
+}
+
+/**
+ * Compare everything but the maps of two versions of a section
+ *
+ * Only maps are changed on a live gateway, anything else in the section
+ * (host settings, auth, session counts...) needs a restart to apply.
+ *
+ * @a		One version of the section
+ * @b		The other
+ * @return	true if the two have the same non-map settings
+ */
+bool same_gw_settings(struct ini_section *a, struct ini_section *b)
+{
+	struct ini_kv_pair *kvp;
+	int n_a = 0, n_b = 0;
+	char *val;
+
+	for(kvp = a->items; kvp != NULL; kvp = kvp->next)	{
+		if(is_port(kvp->key))
+			continue;
+		n_a++;
+		if((val = ini_get_section_value(b, kvp->key)) == NULL ||
+		   strcmp(val, kvp->value) != 0)
+			return false;
+	}
+	for(kvp = b->items; kvp != NULL; kvp = kvp->next)
+		if(!is_port(kvp->key))
+			n_b++;
+	return n_a == n_b;
+}
+
+/* Run everything that parsing the config can fail on, without binding or
+ * connecting anything (autotun -t) */
+void check_configfile(const char *filename)
+{
+	struct ini_section *sec;
+	struct gw_host *gw;
+
+	read_configfile(filename, &sec);
+	for(; sec != NULL; sec = sec->next)	{
+		if(sec->items == NULL)
+			log_exit(CONFIG_ERROR, "Error: section [%s] is empty", sec->name);
+		section_shards(sec);
+		gw = create_gw(sec->name);
+		create_gw_session_config(sec, gw);
+	}
+}
+
+static void remove_config_snapshots(void)
+{
+	char path[PATH_MAX];
+
+	if(snapshot_dir == NULL || getpid() != snapshot_owner)
+		return;
+	snprintf(path, sizeof(path), "%s/checked", snapshot_dir);
+	unlink(path);
+	rmdir(snapshot_dir);
+	free(snapshot_dir);
+	snapshot_dir = NULL;
+}
+
+/**
+ * Make the directory reloads keep the checked config in
+ *
+ * Called by the main process before any gateway (process) starts, so they
+ * all know where to find it.  Removed again at exit.
+ */
+void setup_config_snapshots(void)
+{
+	const char *tmp = getenv("TMPDIR");
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s/autotun.XXXXXX", tmp ? tmp : "/tmp");
+	if(mkdtemp(path) == NULL)
+		log_exit_perror(FATAL_ERROR, "mkdtemp() for config copies");
+	snapshot_dir = safestrdup(path, "config copy dir");
+	snapshot_owner = getpid();
+	atexit(remove_config_snapshots);
+}
+
+/**
+ * Copy the config file aside, so the check and the real parse see the same
+ * contents however the file changes meanwhile
+ *
+ * @filename	The config-file
+ * @path		Filled in with the copy's name, to be unlinked by the caller
+ * @size		Size of @path
+ * @return		0, or -1 (logged) if the copy couldn't be made
+ */
+static int snapshot_configfile(const char *filename, char *path, size_t size)
+{
+	char buf[4096];
+	size_t n;
+	FILE *in;
+	int fd, rc = 0;
+
+	if((in = fopen(filename, "r")) == NULL)	{
+		log_msg("Error opening config file '%s': %s", filename, strerror(errno));
+		return -1;
+	}
+	snprintf(path, size, "%s/new.XXXXXX", snapshot_dir);
+	if((fd = mkstemp(path)) < 0)	{
+		log_msg("Error creating config copy %s: %s", path, strerror(errno));
+		fclose(in);
+		return -1;
+	}
+
+	while(rc == 0 && (n = fread(buf, 1, sizeof(buf), in)) > 0)	{
+		char *p = buf;
+		ssize_t w;
+
+		while(n > 0)	{
+			if((w = write(fd, p, n)) < 0)	{
+				if(errno == EINTR)
+					continue;
+				log_msg("Error copying config file: %s", strerror(errno));
+				rc = -1;
+				break;
+			}
+			p += w;
+			n -= w;
+		}
+	}
+	if(rc == 0 && ferror(in))	{
+		log_msg("Error reading config file '%s'", filename);
+		rc = -1;
+	}
+	fclose(in);
+	close(fd);
+	if(rc < 0)
+		unlink(path);
+	return rc;
+}
+
+/**
+ * Check a config file in a fresh "autotun -t" process
+ *
+ * Spawned rather than forked, the caller may have threads (workers, the log
+ * flush thread) and the check builds gateways and libssh options.  It gets
+ * CONFIG_CHECK_USEC, a check that hangs is killed and counts as failed.
+ *
+ * @path	file to check
+ * @return	true if it passed
+ */
+static bool config_check_ok(const char *path)
+{
+	char *argv[] = { prog_name, "-t", "-f", (char *)path, _debug ? "-d" : NULL,
+					 NULL };
+	struct timespec nap = { 0, 20 * 1000 * 1000 };
+	uint64_t deadline = monotonic_usec() + CONFIG_CHECK_USEC;
+	int rc, status;
+	pid_t pid;
+
+	if((rc = posix_spawn(&pid, "/proc/self/exe", NULL, NULL, argv, environ)) != 0)	{
+		log_msg("Error starting config check: %s", strerror(rc));
+		return false;
+	}
+
+	while((rc = waitpid(pid, &status, WNOHANG)) == 0 ||
+		  (rc < 0 && errno == EINTR))	{
+		if(monotonic_usec() >= deadline)	{
+			log_msg("Config check (pid %d) takes too long, killing it", pid);
+			kill(pid, SIGKILL);
+			while(waitpid(pid, &status, 0) < 0 && errno == EINTR)
+				;
+			return false;
+		}
+		nanosleep(&nap, NULL);
+	}
+	if(rc < 0)	{
+		log_msg("Error waiting for config check: %s", strerror(errno));
+		return false;
+	}
+	return WIFEXITED(status) && WEXITSTATUS(status) == NO_ERROR;
+}
+
+/**
+ * Read the config file again for a reload
+ *
+ * Any error in the file is fatal to whoever parses it, so a copy of it is
+ * checked first in a separate process, then the same copy parsed here.  A
+ * broken file is logged and the running config stays as it is.  A good one
+ * replaces the checked copy the gateway processes reload from, see
+ * read_checked_configfile().  The number of workers can't change without a
+ * restart.
+ *
+ * @filename	The config-file to read
+ * @first_sec	Place to put pointer to first section corresponding to a gw
+ * @return		The new ini-file structure, NULL if the file has errors
+ */
+struct ini_file *
+reread_configfile(const char *filename, struct ini_section **first_sec)
+{
+	struct ini_file *ini;
+	int workers = n_workers;
+	char path[PATH_MAX], checked[PATH_MAX];
+
+	if(snapshot_configfile(filename, path, sizeof(path)) < 0)
+		return NULL;
+
+	if(!config_check_ok(path))	{
+		log_msg("Config file '%s' has errors, keeping the running config",
+				filename);
+		unlink(path);
+		return NULL;
+	}
+
+	/* Readers see the old copy or the new one, never half of either */
+	snprintf(checked, sizeof(checked), "%s/checked", snapshot_dir);
+	if(rename(path, checked) < 0)	{
+		log_msg("Error keeping checked config %s: %s", checked, strerror(errno));
+		unlink(path);
+		return NULL;
+	}
+
+	ini = read_config_as(checked, filename, first_sec);
+	if(n_workers != workers)	{
+		log_msg("Changing the number of workers needs a restart");
+		n_workers = workers;
+	}
+	return ini;
+}
+
+/**
+ * Read the copy of the config the main process checked last
+ *
+ * For a gateway process on reload: the main process checks the file and
+ * only then passes SIGHUP on, so this just parses.  A SIGHUP sent to a
+ * gateway directly, before any reload, finds no copy and changes nothing.
+ *
+ * @filename	The config-file, for messages
+ * @first_sec	Place to put pointer to first section corresponding to a gw
+ * @return		The ini-file structure, NULL if there's no checked copy
+ */
+struct ini_file *
+read_checked_configfile(const char *filename, struct ini_section **first_sec)
+{
+	char path[PATH_MAX];
+
+	if(snapshot_dir == NULL)
+		return NULL;
+	snprintf(path, sizeof(path), "%s/checked", snapshot_dir);
+	if(access(path, R_OK) < 0)	{
+		log_msg("No checked config to reload from, SIGHUP the main process");
+		return NULL;
+	}
+	return read_config_as(path, filename, first_sec);
+}
+
+/**
+ * Bring a running gateway's maps in line with a re-read config
+ *
+ * Maps are matched on their local port.  A map still in the config is
+ * updated in place so its open connections aren't touched, a new one gets
+ * its listener, and one that's gone is drained: it stops listening, and
+ * goes once its last connection has.  A gateway whose section (or shard)
+ * is gone is left draining as a whole.
+ *
+ * @gw		running gateway
+ * @first	first gateway section of the new config
+ */
+void reload_gw(struct gw_host *gw, struct ini_section *first)
+{
+	struct ini_section *sec = find_gw_section(first, gw->name);
+	struct ini_kv_pair *kvp;
+	struct map_opts defaults, mo;
+	int i, n_old = gw->n_maps, n_live = 0;
+	bool *seen;
+	struct backend *be;
+	uint32_t lp;
+	int n_be;
+
+	if(gw->draining)
+		return;
+
+	seen = safemalloc((n_old + 1) * sizeof(bool), "reload seen maps");
+	if(sec != NULL)	{
+		read_map_defaults(sec, &defaults);
+		for(kvp = sec->items; kvp != NULL; kvp = kvp->next)	{
+			if(!is_port(kvp->key))
+				continue;
+			read_map_line(kvp, &defaults, &lp, &be, &n_be, &mo);
+			if(gw->shard > 0 && mo.shards <= gw->shard)	{
+				free_backends(be, n_be);
+				continue;
+			}
+
+			for(i = 0; i < n_old; i++)
+				if(gw->pm[i]->local_port == lp && !gw->pm[i]->draining)
+					break;
+			if(i < n_old)	{
+				update_map(gw->pm[i], be, n_be, &mo);
+				seen[i] = true;
+			} else {
+				log_msg("New map %d -> %s:%d", lp, n_be ? be[0].host : "socks",
+						n_be ? be[0].port : 0);
+				start_map(gw, lp, be, n_be, &mo);
+			}
+			n_live++;
+			free_backends(be, n_be);
+		}
+	}
+
+	for(i = 0; i < n_old; i++)
+		if(!seen[i])
+			drain_map(gw->pm[i]);
+	free(seen);
+
+	if(n_live == 0)	{
+		log_msg("%s (shard %d) is no longer configured, draining it",
+				gw->name, gw->shard);
+		__atomic_store_n(&gw->draining, true, __ATOMIC_RELAXED);
+	}
+}
@@ -0,0 +1,89 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#include "util.h"
+#include "event.h"
+
+/**
+ * Create a new epoll-backed event loop
+ *
+ * The loop keeps one epoll set plus a result array big enough to hold
+ * @max_events ready descriptors per call to event_wait().  Each registered
+ * descriptor is stored with its fd as the event data, so callers look up
+ * the owning object in their own fd_map after a wakeup.
+ *
+ * @max_events	Maximum number of ready events returned per wakeup
+ * @return		The new loop, any failure here is fatal
+ */
+struct event_loop *new_event_loop(int max_events)
+{
+	struct event_loop *ev = safemalloc(sizeof(struct event_loop), "event loop");
+
+	if((ev->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+		log_exit_perror(FATAL_ERROR, "epoll_create1()");
+
+	ev->max_events = max_events;
+	ev->events = safemalloc(max_events * sizeof(struct epoll_event),
+							"event loop results");
+	return ev;
+}
+
+static void event_ctl(struct event_loop *ev, int op, int fd, uint32_t events)
+{
+	struct epoll_event e;
+
+	memset(&e, 0, sizeof(e));
+	e.events = events;
+	e.data.fd = fd;
+	if(epoll_ctl(ev->epfd, op, fd, &e) < 0)
+		log_exit_perror(FATAL_ERROR, "epoll_ctl(%d) on fd=%d", op, fd);
+}
+
+void event_add(struct event_loop *ev, int fd, uint32_t events)
+{
+	event_ctl(ev, EPOLL_CTL_ADD, fd, events);
+}
+
+void event_mod(struct event_loop *ev, int fd, uint32_t events)
+{
+	event_ctl(ev, EPOLL_CTL_MOD, fd, events);
+}
+
+/* Removing an fd that the kernel already dropped (closed) is not an error */
+void event_del(struct event_loop *ev, int fd)
+{
+	struct epoll_event e;
+
+	if(epoll_ctl(ev->epfd, EPOLL_CTL_DEL, fd, &e) < 0 &&
+	   errno != ENOENT && errno != EBADF)
+		log_error("epoll_ctl(DEL) on fd=%d: %s", fd, strerror(errno));
+}
+
+/**
+ * Wait for events on the loop
+ *
+ * @ev			The event loop
+ * @timeout_ms	Timeout in milliseconds, -1 blocks indefinitely
+ * @return		Number of ready events in ev->events, or -1 if interrupted
+ */
+int event_wait(struct event_loop *ev, int timeout_ms)
+{
+	int n;
+
+	n = epoll_wait(ev->epfd, ev->events, ev->max_events, timeout_ms);
+	if(n < 0 && errno != EINTR)
+		log_exit_perror(FATAL_ERROR, "epoll_wait()");
+
+	return n;
+}
+
+void del_event_loop(struct event_loop *ev)
+{
+	close(ev->epfd);
+	free(ev->events);
+	free(ev);
+}
@@ -4,14 +4,20 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <sys/resource.h>
 #include <signal.h>
 #include <stddef.h>
+#include <errno.h>
 
 #include "autotun.h"
 #include "pflock.h"
 #include "config.h"
 #include "port_map.h"
 #include "ssh.h"
+#include "stats.h"
+#include "worker.h"
+#include "net.h"
+#include "metrics.h"
 
 
 int _debug = 0;
@@ -21,18 +27,27 @@ char *cfgfile = NULL;
 
 char *default_cfg = ".autotunrc";
 
+/* -t: only check the config file, see reread_configfile() */
+static bool check_only = false;
+
 void parseopts(int argc, char *argv[])
 {
 	int c;
 
-	while((c=getopt(argc, argv, "vdf:")) != -1)	{
+	while((c=getopt(argc, argv, "vdtf:")) != -1)	{
 		switch(c)	{
 			case 'd':
+#ifdef NO_DEBUG_LOG
+				log_msg("Built without debug logging, -d ignored");
+#endif
 				_debug = 1;
 				break;
 			case 'v':
 				_verbose = 1;
 				break;
+			case 't':
+				check_only = true;
+				break;
 			case 'f':
 				cfgfile = safestrdup(optarg, "cfgfile optarg");
 				break;
@@ -49,8 +64,45 @@ void parseopts(int argc, char *argv[])
 	}
 }
 
+/* The event loop isn't bound by FD_SETSIZE, so let the fd limit be too */
+static void raise_fd_limit(void)
+{
+	struct rlimit rl;
+
+	if(getrlimit(RLIMIT_NOFILE, &rl) < 0)
+		log_exit_perror(FATAL_ERROR, "getrlimit(RLIMIT_NOFILE)");
+
+	if(rl.rlim_cur < rl.rlim_max)	{
+		rl.rlim_cur = rl.rlim_max;
+		if(setrlimit(RLIMIT_NOFILE, &rl) < 0)
+			log_msg("Cannot raise open file limit: %s", strerror(errno));
+	}
+	debug("Open file limit is %llu", (unsigned long long)rl.rlim_cur);
+}
+
 struct pflock *proc_per_gw;
 
+/* What a gateway process serves, the parent keeps this for reloads */
+struct gw_child {
+	char *name;
+	int shard;
+};
+
+/* The child is dropped from the flock right after, see
+ * pflock_wait_remove(), so its handle goes here.  Gateways that crashed
+ * leave their metrics slots behind too. */
+static void gw_child_gone(pfproc p, int code)
+{
+	struct gw_child *c = p->handle;
+
+	metrics_reclaim(p->pid);
+	if(c != NULL)	{
+		free(c->name);
+		free(c);
+		p->handle = NULL;
+	}
+}
+
 void exit_cleanup(void)
 {
 	int num;
@@ -65,22 +117,164 @@ void exit_cleanup(void)
 	}
 }
 
-int main(int argc, char *argv[])
+/**
+ * Fork the process for one gateway (shard) of the config
+ *
+ * The child builds its gateway from @sec and waits for the parent's go
+ * signal (SIGUSR1), which must be blocked when this is called.  It never
+ * returns.
+ *
+ * @ini		The whole config, freed in the child once it's read
+ * @sec		The gateway's section
+ * @shard	Which shard of the section
+ * @return	The new process in the parent
+ */
+static pfproc start_gw_child(struct ini_file *ini, struct ini_section *sec,
+							 int shard)
 {
+	struct gw_child *c = safemalloc(sizeof(struct gw_child), "gw child");
 	struct gw_host *gw;
+	pfproc p;
+
+	c->name = safestrdup(sec->name, "gw child name");
+	c->shard = shard;
+	if((p = pflock_fork_data(proc_per_gw, c)) != NULL)
+		return p;
+
+	pflock_destroy(proc_per_gw);
+	proc_per_gw = NULL;
+	metrics_forked();
+	log_start_async();
+	prog_name = safemalloc(64, "new progname");
+	if(shard == 0)
+		snprintf(prog_name, 63, "autotun-%s", sec->name);
+	else
+		snprintf(prog_name, 63, "autotun-%s.%d", sec->name, shard);
+	debug("New child process pid %d", getpid());
+
+	setup_signals_for_child();
+	gw = process_section_to_gw(sec, shard);
+	ini_free_data(ini);
+
+	exit(run_gateway(gw));
+}
+
+/* Is there a running process for this gateway shard already? */
+static bool have_gw_child(const char *name, int shard)
+{
+	int i;
+
+	for(i = 0; i < proc_per_gw->n_procs; i++)	{
+		pfproc p = proc_per_gw->flock[i];
+		struct gw_child *c = p->handle;
+
+		if(p->status == PF_RUNNING && c->shard == shard &&
+		   strcmp(c->name, name) == 0)
+			return true;
+	}
+	return false;
+}
+
+/**
+ * Apply a changed config file to the running gateway processes
+ *
+ * The file is re-read (and checked) here first.  Every gateway that's still
+ * in it gets SIGHUP and diffs its own maps, see reload_gw().  Gateways (or
+ * shards) no longer in the config are told to finish, which drains their
+ * connections, and new ones get a process.  Changes to a gateway's other
+ * settings only take effect on restart.
+ *
+ * @ini		The running config, replaced by the new one on success
+ * @bmask	The signals to block around forking
+ */
+static void reload_children(struct ini_file **ini, sigset_t *bmask)
+{
+	struct ini_section *sec, *old_first, *old;
+	struct ini_file *new_ini;
+	int i, shard;
+
+	log_msg("Reloading config file %s", cfgfile);
+	if((new_ini = reread_configfile(cfgfile, &sec)) == NULL)
+		return;
+	old_first = (*ini)->first;
+	if(old_first != NULL && strcmp(old_first->name, "") == 0)
+		old_first = old_first->next;
+
+	for(i = 0; i < proc_per_gw->n_procs; i++)	{
+		pfproc p = proc_per_gw->flock[i];
+		struct gw_child *c = p->handle;
+		struct ini_section *s;
+
+		if(p->status != PF_RUNNING)
+			continue;
+		s = find_gw_section(sec, c->name);
+		if(s != NULL && c->shard < section_shards(s))	{
+			kill(p->pid, SIGHUP);
+			continue;
+		}
+		debug("Finishing %s shard %d, no longer configured", c->name, c->shard);
+		kill(p->pid, SIGINT);
+	}
+
+	sigprocmask(SIG_BLOCK, bmask, NULL);
+	for(; sec != NULL; sec = sec->next)	{
+		int n_shards = section_shards(sec);
+
+		old = find_gw_section(old_first, sec->name);
+		if(old != NULL && !same_gw_settings(old, sec))
+			log_msg("Settings of [%s] other than its maps changed, they take "
+					"effect on restart", sec->name);
+
+		for(shard = 0; shard < n_shards; shard++)	{
+			pfproc p;
+
+			if(have_gw_child(sec->name, shard))
+				continue;
+			p = start_gw_child(new_ini, sec, shard);
+			log_msg("Started %s shard %d (pid %d)", sec->name, shard, p->pid);
+			kill(p->pid, SIGUSR1);
+		}
+	}
+	sigprocmask(SIG_UNBLOCK, bmask, NULL);
+
+	ini_free_data(*ini);
+	*ini = new_ini;
+}
+
+int main(int argc, char *argv[])
+{
 	struct ini_file *ini;
 	struct ini_section *sec;
 	sigset_t bmask;
-	int idx;
+	int idx, shard;
 
 	debug_stream = stderr;
 
 	parseopts(argc, argv);
+	if(check_only)	{
+		check_configfile(cfgfile);
+		return NO_ERROR;
+	}
+	raise_fd_limit();
+	reserve_spare_fd();
 
 	ini = read_configfile(cfgfile, &sec);
-	free(cfgfile);
+	setup_config_snapshots();
+	prepare_cipher_prefs(sec);
+	metrics_init(stats_socket);
+
+	/* All gateways in this process, on a few threads */
+	if(n_workers > 0)	{
+		setup_signals_parent();
+		log_start_async();
+		run_workers(sec, n_workers);
+		ini_free_data(ini);
+		ssh_finalize();
+		metrics_close();
+		return 0;
+	}
 
-	proc_per_gw = pflock_new(NULL, NULL);
+	proc_per_gw = pflock_new(gw_child_gone, gw_child_gone);
 
 	sigemptyset(&bmask);
 	sigaddset(&bmask ,SIGUSR1);
@@ -88,21 +282,12 @@ int main(int argc, char *argv[])
 	if(sigprocmask(SIG_BLOCK, &bmask, NULL) < 0)
 		log_exit_perror(FATAL_ERROR, "sigprocmask() blocking setup");
 
+	/* A process per gateway, and one more for each extra shard */
 	while(sec)	{
-		if(pflock_fork_data(proc_per_gw, sec) == NULL)	{
-			pflock_destroy(proc_per_gw);
-			prog_name = safemalloc(64, "new progname");
-			snprintf(prog_name, 63, "autotun-%s", sec->name);
-			debug("New child process pid %d", getpid());
-
-			setup_signals_for_child();
-			gw = process_section_to_gw(sec);
-			ini_free_data(ini);
-
-			connect_ssh_session(gw->session);
-			authenticate_ssh_session(gw->session, gw->auth);
-			return run_gateway(gw);
-		}
+		int n_shards = section_shards(sec);
+
+		for(shard = 0; shard < n_shards; shard++)
+			start_gw_child(ini, sec, shard);
 		sec = sec->next;
 	}
 
@@ -114,21 +299,44 @@ int main(int argc, char *argv[])
 
 
 	do	{
-		idx = pflock_wait_remove(proc_per_gw, PF_KILLED);
-		debug("pflock_wait(): returned %d%s", idx,
-			  (idx == PFW_REMOVED) ? ": Removed proc from flock" : "");
+		/* With a stats socket to serve, look in on the children each second */
+		if(metrics_serving() && pflock_poll(proc_per_gw) == PFW_NONBLK)	{
+			metrics_poll(1000);
+			idx = PFW_AGAIN;
+		} else {
+			idx = pflock_wait_remove(proc_per_gw, PF_KILLED | PF_EXITED);
+			debug("pflock_wait(): returned %d%s", idx,
+				  (idx == PFW_REMOVED) ? ": Removed proc from flock" : "");
+		}
+		if(dump_stats)	{
+			debug("Forwarding stats request to all");
+			pflock_sendall(proc_per_gw, SIGUSR2);
+			dump_stats = false;
+		}
 		if(finish_main_loop != 0)	{
 			debug("Sending %s to all", !hard_shutdown ? "SIGINT" : "SIGTERM");
 			pflock_sendall(proc_per_gw, hard_shutdown ? SIGTERM : SIGINT );
 			finish_main_loop = 0;
+		} else if(reload_config)	{
+			reload_config = false;
+			reload_children(&ini, &bmask);
 		}
 	} while(idx != PFW_NOCHILD && idx != PFW_ERROR && !hard_shutdown);
 
 	if(pflock_get_numrun(proc_per_gw) > 0)
 		pflock_sendall(proc_per_gw, SIGTERM);
 
+	for(idx = 0; idx < proc_per_gw->n_procs; idx++)	{
+		struct gw_child *c = proc_per_gw->flock[idx]->handle;
+
+		free(c->name);
+		free(c);
+	}
 	ini_free_data(ini);
 	pflock_destroy(proc_per_gw);
+	metrics_close();
+	free(stats_socket);
+	free(cfgfile);
 	return 0;
 }
 
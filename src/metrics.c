@@ -0,0 +1,692 @@
+/* MAP_ANONYMOUS and accept4() are Linux extensions */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "util.h"
+#include "net.h"
+#include "metrics.h"
+
+/* The segment every gateway process writes its slots to, mapped before the
+ * first fork.  NULL without a stats socket, slots are private then. */
+static struct metrics_slot *slots = NULL;
+static int stats_fd = -1;
+static char *stats_path = NULL;
+
+/* Upper bounds of the histogram buckets in usec, the last bucket is +Inf */
+static const uint64_t bucket_usec[METRICS_BUCKETS - 1] = {
+	100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000,
+	250000, 500000, 1000000, 2500000, 5000000,
+};
+
+#define N_COUNTERS (sizeof(struct metric_counters) / sizeof(uint64_t))
+
+struct outbuf {
+	char *p;
+	size_t len;
+	size_t size;
+};
+
+/* Stats clients being served at once, more wait in the listen backlog */
+#define STATS_CLIENTS 8
+/* How long a client gets to send its request line, after that it's given
+ * plain text; and how long to take the whole answer */
+#define STATS_REQ_USEC (200 * 1000)
+#define STATS_CLIENT_USEC (5 * 1000 * 1000)
+
+/* A stats connection, reading its request until out.p is set, then
+ * writing the answer */
+struct stats_client {
+	int fd;
+	uint64_t req_deadline;
+	uint64_t deadline;
+	char req[256];
+	size_t req_len;
+	struct outbuf out;
+	size_t sent;
+};
+
+static struct stats_client clients[STATS_CLIENTS];
+static int n_clients = 0;
+
+static void drop_client(int i)
+{
+	close(clients[i].fd);
+	free(clients[i].out.p);
+	clients[i] = clients[--n_clients];
+}
+
+static inline bool in_segment(const struct metrics_slot *m)
+{
+	return slots != NULL && m >= slots && m < slots + METRICS_SLOTS;
+}
+
+/**
+ * Set up the shared counters and the stats socket
+ *
+ * Called once in the parent before any gateway is created, so every
+ * process forked after shares the segment.  A stale socket left by a
+ * previous run is removed, anything else at @path is an error.
+ *
+ * @path	Where to listen, NULL for no stats socket
+ */
+void metrics_init(const char *path)
+{
+	struct sockaddr_un sa;
+	struct stat st;
+
+	if(path == NULL)
+		return;
+
+	slots = mmap(NULL, METRICS_SLOTS * sizeof(struct metrics_slot),
+				 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if(slots == MAP_FAILED)
+		log_exit_perror(FATAL_ERROR, "mmap() for the metrics segment");
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	if(strlen(path) >= sizeof(sa.sun_path))
+		log_exit(CONFIG_ERROR, "Error: stats_socket path too long: %s", path);
+	strcpy(sa.sun_path, path);
+
+	if(lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(path);
+
+	if((stats_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+		log_exit_perror(SOCKET_ERROR, "socket() for stats");
+	if(bind(stats_fd, (struct sockaddr *)&sa, sizeof(sa)) < 0)
+		log_exit_perror(SOCKET_ERROR, "bind stats socket %s", path);
+	if(listen(stats_fd, 16) < 0 || set_nonblocking(stats_fd) < 0)
+		log_exit_perror(SOCKET_ERROR, "listen on stats socket %s", path);
+
+	stats_path = safestrdup(path, "stats socket path");
+	debug("Serving stats on %s", path);
+}
+
+/* A gateway process keeps the segment but the socket is the parent's */
+void metrics_forked(void)
+{
+	while(n_clients > 0)
+		drop_client(n_clients - 1);
+	if(stats_fd >= 0)
+		close(stats_fd);
+	stats_fd = -1;
+	free(stats_path);
+	stats_path = NULL;
+}
+
+void metrics_close(void)
+{
+	if(stats_fd < 0)
+		return;
+	unlink(stats_path);
+	metrics_forked();
+	munmap(slots, METRICS_SLOTS * sizeof(struct metrics_slot));
+	slots = NULL;
+}
+
+bool metrics_serving(void)
+{
+	return stats_fd >= 0;
+}
+
+/**
+ * Take a slot for a gateway (@local_port 0) or one of its maps
+ *
+ * Processes and threads claim slots concurrently, a compare-and-swap on the
+ * state makes one the owner.  The slot is only shown once it's filled in.
+ * With the segment full (or no segment) the slot is private memory, it's
+ * counted but not shown.
+ *
+ * @gw_name		gateway the slot is for
+ * @shard		which shard of it
+ * @local_port	map's port, 0 for the gateway itself
+ * @return		The slot, free it with metrics_slot_free()
+ */
+struct metrics_slot *metrics_slot_new(const char *gw_name, int shard,
+									  uint32_t local_port)
+{
+	struct metrics_slot *m = NULL;
+	uint32_t expect;
+	int i;
+
+	for(i = 0; slots != NULL && i < METRICS_SLOTS; i++)	{
+		expect = SLOT_FREE;
+		if(__atomic_compare_exchange_n(&slots[i].state, &expect, SLOT_INIT,
+									   false, __ATOMIC_ACQUIRE,
+									   __ATOMIC_RELAXED))	{
+			m = &slots[i];
+			break;
+		}
+	}
+	if(m == NULL)	{
+		if(slots != NULL)
+			log_msg("No metrics slot left for %s port %d, not shown in stats",
+					gw_name, local_port);
+		m = safemalloc(sizeof(struct metrics_slot), "private metrics slot");
+	}
+
+	m->pid = getpid();
+	m->shard = shard;
+	m->local_port = local_port;
+	snprintf(m->gw_name, sizeof(m->gw_name), "%s", gw_name);
+	memset(&m->c, 0, sizeof(m->c));
+	m->n_sessions = 0;
+	m->n_sess_lost = 0;
+	if(in_segment(m))
+		__atomic_store_n(&m->state, SLOT_LIVE, __ATOMIC_RELEASE);
+	return m;
+}
+
+/**
+ * Give up a slot, its counters go to @into so the totals don't drop
+ *
+ * @m		slot to free
+ * @into	the gateway's slot for a map's, NULL for the gateway's own
+ */
+void metrics_slot_free(struct metrics_slot *m, struct metrics_slot *into)
+{
+	uint64_t *from = (uint64_t *)&m->c, *to;
+	size_t i;
+
+	if(into != NULL)	{
+		to = (uint64_t *)&into->c;
+		for(i = 0; i < N_COUNTERS; i++)
+			metric_add(&to[i], from[i]);
+	}
+
+	if(in_segment(m))
+		__atomic_store_n(&m->state, SLOT_FREE, __ATOMIC_RELEASE);
+	else
+		free(m);
+}
+
+/* A gateway process died without freeing its slots */
+void metrics_reclaim(pid_t pid)
+{
+	int i;
+
+	for(i = 0; slots != NULL && i < METRICS_SLOTS; i++)
+		if(__atomic_load_n(&slots[i].state, __ATOMIC_ACQUIRE) == SLOT_LIVE &&
+		   slots[i].pid == pid)
+			__atomic_store_n(&slots[i].state, SLOT_FREE, __ATOMIC_RELEASE);
+}
+
+static int bucket(uint64_t usec)
+{
+	int i;
+
+	for(i = 0; i < METRICS_BUCKETS - 1; i++)
+		if(usec <= bucket_usec[i])
+			break;
+	return i;
+}
+
+void metrics_open_latency(struct metrics_slot *m, uint64_t usec)
+{
+	metric_add(&m->c.n_opened, 1);
+	metric_add(&m->c.open_usec, usec);
+	metric_add(&m->c.open_hist[bucket(usec)], 1);
+}
+
+void metrics_ttfb(struct metrics_slot *m, uint64_t usec)
+{
+	metric_add(&m->c.n_ttfb, 1);
+	metric_add(&m->c.ttfb_usec, usec);
+	metric_add(&m->c.ttfb_hist[bucket(usec)], 1);
+}
+
+/* Totals for a gateway (over its shards and dropped maps) or for a map
+ * (over its shards) */
+struct metrics_agg {
+	char gw_name[METRICS_NAME_MAX];
+	uint32_t local_port;
+	struct metric_counters c;
+	uint64_t n_sessions;
+	uint64_t n_sess_lost;
+};
+
+static struct metrics_agg *find_agg(struct metrics_agg *a, int *n,
+									const char *gw_name, uint32_t local_port)
+{
+	int i;
+
+	for(i = 0; i < *n; i++)
+		if(a[i].local_port == local_port && strcmp(a[i].gw_name, gw_name) == 0)
+			return &a[i];
+	snprintf(a[*n].gw_name, sizeof(a[*n].gw_name), "%s", gw_name);
+	a[*n].local_port = local_port;
+	return &a[(*n)++];
+}
+
+/**
+ * Sum up the live slots of all gateway processes
+ *
+ * Each counter is read on its own, so a total may be a few updates behind
+ * but is never torn.  A slot being reused while it's read can be off once.
+ *
+ * @a		room for 2 * METRICS_SLOTS totals, zeroed
+ * @return	Number of totals in @a, every gateway's comes before its maps'
+ */
+static int aggregate(struct metrics_agg *a)
+{
+	struct metrics_slot *m;
+	struct metrics_agg *g, *pm;
+	uint64_t v, *from;
+	size_t j;
+	int i, n = 0;
+
+	for(i = 0; i < METRICS_SLOTS; i++)	{
+		m = &slots[i];
+		if(__atomic_load_n(&m->state, __ATOMIC_ACQUIRE) != SLOT_LIVE)
+			continue;
+
+		g = find_agg(a, &n, m->gw_name, 0);
+		pm = (m->local_port != 0) ? find_agg(a, &n, m->gw_name, m->local_port)
+								  : NULL;
+		from = (uint64_t *)&m->c;
+		for(j = 0; j < N_COUNTERS; j++)	{
+			v = __atomic_load_n(&from[j], __ATOMIC_RELAXED);
+			((uint64_t *)&g->c)[j] += v;
+			if(pm != NULL)
+				((uint64_t *)&pm->c)[j] += v;
+		}
+		g->n_sessions += __atomic_load_n(&m->n_sessions, __ATOMIC_RELAXED);
+		g->n_sess_lost += __atomic_load_n(&m->n_sess_lost, __ATOMIC_RELAXED);
+	}
+	return n;
+}
+
+static void out_printf(struct outbuf *o, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	for(;;)	{
+		va_start(ap, fmt);
+		n = vsnprintf(o->p + o->len, o->size - o->len, fmt, ap);
+		va_end(ap);
+		if(n < 0)
+			return;
+		if(o->len + n < o->size)
+			break;
+		o->size = (o->size + n) * 2;
+		saferealloc((void **)&o->p, o->size, "stats output");
+	}
+	o->len += n;
+}
+
+/* Upper bound of the bucket holding the 99th percentile, 0 if unknown */
+uint64_t metrics_p99_usec(const uint64_t *hist, uint64_t count)
+{
+	uint64_t seen = 0;
+	int i;
+
+	for(i = 0; i < METRICS_BUCKETS - 1; i++)	{
+		seen += hist[i];
+		if(seen * 100 >= count * 99)
+			return bucket_usec[i];
+	}
+	return 0;
+}
+
+static void text_counters(struct outbuf *o, const struct metric_counters *c)
+{
+	out_printf(o, "%llu active, %llu accepted, %llu failed, "
+			   "%llu bytes in, %llu bytes out",
+			   (unsigned long long)c->n_active,
+			   (unsigned long long)c->n_accepted,
+			   (unsigned long long)c->n_failed,
+			   (unsigned long long)c->bytes_in,
+			   (unsigned long long)c->bytes_out);
+	if(c->n_opened > 0)
+		out_printf(o, ", open avg %llu us p99 <= %llu us",
+				   (unsigned long long)(c->open_usec / c->n_opened),
+				   (unsigned long long)metrics_p99_usec(c->open_hist, c->n_opened));
+	if(c->n_ttfb > 0)
+		out_printf(o, ", first byte avg %llu us p99 <= %llu us",
+				   (unsigned long long)(c->ttfb_usec / c->n_ttfb),
+				   (unsigned long long)metrics_p99_usec(c->ttfb_hist, c->n_ttfb));
+	out_printf(o, "\n");
+}
+
+static void format_text(struct outbuf *o, struct metrics_agg *a, int n)
+{
+	int i, j;
+
+	for(i = 0; i < n; i++)	{
+		if(a[i].local_port != 0)
+			continue;
+		out_printf(o, "gateway %s: %llu sessions up, %llu lost, ",
+				   a[i].gw_name, (unsigned long long)a[i].n_sessions,
+				   (unsigned long long)a[i].n_sess_lost);
+		text_counters(o, &a[i].c);
+		for(j = i + 1; j < n; j++)	{
+			if(a[j].local_port == 0 || strcmp(a[j].gw_name, a[i].gw_name) != 0)
+				continue;
+			out_printf(o, "  port %u: ", a[j].local_port);
+			text_counters(o, &a[j].c);
+		}
+	}
+}
+
+/* Counters and gauges exported for both gateways and maps */
+static const struct prom_def {
+	const char *name;
+	const char *type;
+	const char *help;
+	size_t offset;
+} prom_defs[] = {
+	{ "bytes_in_total", "counter", "Bytes from clients sent to the gateway",
+	  offsetof(struct metric_counters, bytes_in) },
+	{ "bytes_out_total", "counter", "Bytes from the gateway sent to clients",
+	  offsetof(struct metric_counters, bytes_out) },
+	{ "connections_accepted_total", "counter", "Client connections accepted",
+	  offsetof(struct metric_counters, n_accepted) },
+	{ "connections_active", "gauge", "Client connections open",
+	  offsetof(struct metric_counters, n_active) },
+	{ "connections_failed_total", "counter",
+	  "Client connections dropped without a channel",
+	  offsetof(struct metric_counters, n_failed) },
+	{ "pool_hits_total", "counter", "Clients given a pre-opened channel",
+	  offsetof(struct metric_counters, n_pool_hits) },
+	{ "channel_open_failed_total", "counter", "Channel opens that failed",
+	  offsetof(struct metric_counters, n_open_failed) },
+	{ "connections_shed_total", "counter",
+	  "Clients closed right away for lack of descriptors",
+	  offsetof(struct metric_counters, n_shed) },
+	{ "hold_full_total", "counter",
+	  "Clients turned away while the gateway was down",
+	  offsetof(struct metric_counters, n_hold_full) },
+	{ "hold_expired_total", "counter",
+	  "Clients dropped after waiting too long for the gateway",
+	  offsetof(struct metric_counters, n_hold_expired) },
+	{ NULL, NULL, NULL, 0 },
+};
+
+static void prom_labels(char *buf, size_t len, const struct metrics_agg *a)
+{
+	if(a->local_port == 0)
+		snprintf(buf, len, "gateway=\"%s\"", a->gw_name);
+	else
+		snprintf(buf, len, "gateway=\"%s\",port=\"%u\"", a->gw_name,
+				 a->local_port);
+}
+
+static void prom_histogram(struct outbuf *o, const char *family,
+						   const char *help, struct metrics_agg *a, int n,
+						   bool maps, size_t hist, size_t sum, size_t count)
+{
+	char labels[METRICS_NAME_MAX + 32];
+	const uint64_t *h;
+	uint64_t cum;
+	int i, b;
+
+	out_printf(o, "# HELP %s %s\n# TYPE %s histogram\n", family, help, family);
+	for(i = 0; i < n; i++)	{
+		if((a[i].local_port != 0) != maps)
+			continue;
+		prom_labels(labels, sizeof(labels), &a[i]);
+		h = (const uint64_t *)((const char *)&a[i].c + hist);
+		for(b = 0, cum = 0; b < METRICS_BUCKETS; b++)	{
+			cum += h[b];
+			if(b < METRICS_BUCKETS - 1)
+				out_printf(o, "%s_bucket{%s,le=\"%g\"} %llu\n", family, labels,
+						   bucket_usec[b] / 1e6, (unsigned long long)cum);
+			else
+				out_printf(o, "%s_bucket{%s,le=\"+Inf\"} %llu\n", family,
+						   labels, (unsigned long long)cum);
+		}
+		out_printf(o, "%s_sum{%s} %g\n%s_count{%s} %llu\n", family, labels,
+				   *(const uint64_t *)((const char *)&a[i].c + sum) / 1e6,
+				   family, labels,
+				   (unsigned long long)*(const uint64_t *)((const char *)&a[i].c +
+														   count));
+	}
+}
+
+/* Prometheus text exposition, autotun_gateway_* and autotun_map_* */
+static void format_prometheus(struct outbuf *o, struct metrics_agg *a, int n)
+{
+	static const char *kinds[] = { "gateway", "map" };
+	const struct prom_def *d;
+	char labels[METRICS_NAME_MAX + 32], family[96];
+	int i, k;
+
+	for(d = prom_defs; d->name != NULL; d++)	{
+		for(k = 0; k < 2; k++)	{
+			snprintf(family, sizeof(family), "autotun_%s_%s", kinds[k], d->name);
+			out_printf(o, "# HELP %s %s\n# TYPE %s %s\n", family, d->help,
+					   family, d->type);
+			for(i = 0; i < n; i++)	{
+				if((a[i].local_port != 0) != k)
+					continue;
+				prom_labels(labels, sizeof(labels), &a[i]);
+				out_printf(o, "%s{%s} %llu\n", family, labels,
+						   (unsigned long long)*(const uint64_t *)
+						   ((const char *)&a[i].c + d->offset));
+			}
+		}
+	}
+
+	out_printf(o, "# HELP autotun_gateway_sessions Sessions up\n"
+			   "# TYPE autotun_gateway_sessions gauge\n");
+	for(i = 0; i < n; i++)
+		if(a[i].local_port == 0)
+			out_printf(o, "autotun_gateway_sessions{gateway=\"%s\"} %llu\n",
+					   a[i].gw_name, (unsigned long long)a[i].n_sessions);
+	out_printf(o, "# HELP autotun_gateway_sessions_lost_total Sessions that "
+			   "died\n# TYPE autotun_gateway_sessions_lost_total counter\n");
+	for(i = 0; i < n; i++)
+		if(a[i].local_port == 0)
+			out_printf(o, "autotun_gateway_sessions_lost_total{gateway=\"%s\"} "
+					   "%llu\n", a[i].gw_name,
+					   (unsigned long long)a[i].n_sess_lost);
+
+	for(k = 0; k < 2; k++)	{
+		snprintf(family, sizeof(family), "autotun_%s_open_seconds", kinds[k]);
+		prom_histogram(o, family, "Time to open a channel", a, n, k,
+					   offsetof(struct metric_counters, open_hist),
+					   offsetof(struct metric_counters, open_usec),
+					   offsetof(struct metric_counters, n_opened));
+		snprintf(family, sizeof(family), "autotun_%s_first_byte_seconds",
+				 kinds[k]);
+		prom_histogram(o, family, "Time from accept to the first byte back",
+					   a, n, k, offsetof(struct metric_counters, ttfb_hist),
+					   offsetof(struct metric_counters, ttfb_usec),
+					   offsetof(struct metric_counters, n_ttfb));
+	}
+}
+
+/**
+ * Put together the answer to a client's request
+ *
+ * The request is a single line: "prometheus" for the Prometheus text
+ * format, an HTTP GET (curl --unix-socket) gets the same over HTTP, and
+ * anything else (or nothing) gets plain text.
+ *
+ * @c		client whose request is in (or has timed out)
+ */
+static void answer_client(struct stats_client *c)
+{
+	struct metrics_agg *a;
+	struct outbuf *o = &c->out;
+	char hdr[128];
+	bool http, prom;
+	size_t body;
+	int n_agg, n;
+
+	c->req[c->req_len] = '\0';
+	http = (strncmp(c->req, "GET ", 4) == 0);
+	prom = http || strncmp(c->req, "prometheus", 10) == 0;
+
+	a = safemalloc(2 * METRICS_SLOTS * sizeof(struct metrics_agg), "stats totals");
+	n_agg = aggregate(a);
+	o->size = 4096;
+	o->p = safemalloc(o->size, "stats output");
+	if(prom)
+		format_prometheus(o, a, n_agg);
+	else
+		format_text(o, a, n_agg);
+	free(a);
+
+	/* The header goes in front, now that the length is known */
+	if(http)	{
+		body = o->len;
+		n = snprintf(hdr, sizeof(hdr), "HTTP/1.0 200 OK\r\nContent-Type: "
+					 "text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n",
+					 body);
+		if(o->len + n >= o->size)	{
+			o->size = o->len + n + 1;
+			saferealloc((void **)&o->p, o->size, "stats output");
+		}
+		memmove(o->p + n, o->p, body);
+		memcpy(o->p, hdr, n);
+		o->len += n;
+	}
+	c->sent = 0;
+}
+
+/* Read what the client sent, true once the request is complete */
+static bool read_request(struct stats_client *c)
+{
+	ssize_t n;
+
+	for(;;)	{
+		n = recv(c->fd, c->req + c->req_len, sizeof(c->req) - 1 - c->req_len, 0);
+		if(n < 0)
+			return errno != EAGAIN && errno != EINTR;
+		if(n == 0)
+			return true;
+		c->req_len += n;
+		if(c->req_len == sizeof(c->req) - 1 ||
+		   memchr(c->req, '\n', c->req_len) != NULL)
+			return true;
+	}
+}
+
+/* Send what the socket takes, true once the answer is out (or the client
+ * went away) */
+static bool write_answer(struct stats_client *c)
+{
+	ssize_t n;
+
+	while(c->sent < c->out.len)	{
+		n = send(c->fd, c->out.p + c->sent, c->out.len - c->sent,
+				 MSG_NOSIGNAL | MSG_DONTWAIT);
+		if(n < 0)	{
+			if(errno == EINTR)
+				continue;
+			if(errno == EAGAIN)
+				return false;
+			debug("Stats client went away: %s", strerror(errno));
+			return true;
+		}
+		c->sent += n;
+	}
+	return true;
+}
+
+/* Move client @i along, false once it's done with */
+static bool serve_client(int i, short revents, uint64_t now)
+{
+	struct stats_client *c = &clients[i];
+
+	if(c->out.p == NULL)	{
+		bool done = (revents & (POLLIN | POLLHUP | POLLERR)) && read_request(c);
+
+		if(!done && now < c->req_deadline)
+			return true;
+		answer_client(c);
+	}
+	if(write_answer(c))
+		return false;
+	if(now >= c->deadline)	{
+		debug("Stats client too slow, dropped");
+		return false;
+	}
+	return true;
+}
+
+static void accept_clients(uint64_t now)
+{
+	struct stats_client *c;
+	int fd;
+
+	while(n_clients < STATS_CLIENTS &&
+		  (fd = accept4(stats_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK)) >= 0)	{
+		c = &clients[n_clients++];
+		memset(c, 0, sizeof(*c));
+		c->fd = fd;
+		c->req_deadline = now + STATS_REQ_USEC;
+		c->deadline = now + STATS_CLIENT_USEC;
+	}
+}
+
+/**
+ * Wait up to @ms for stats clients and move them along
+ *
+ * Used as the sleep of the parent's (or, with workers, the main thread's)
+ * loop, a signal ends the wait early.  Nothing here blocks: clients are
+ * polled with the listener, one that doesn't send a request soon gets plain
+ * text and one that doesn't take its answer is dropped.
+ *
+ * @ms		most milliseconds to wait
+ */
+void metrics_poll(int ms)
+{
+	struct pollfd pfd[STATS_CLIENTS + 1];
+	uint64_t now = monotonic_usec(), wait;
+	int i, n_fds, listen_idx = -1;
+
+	if(stats_fd < 0)	{
+		poll(NULL, 0, ms);
+		return;
+	}
+
+	/* Wake in time for the first request that runs out */
+	for(i = 0; i < n_clients; i++)	{
+		uint64_t d = (clients[i].out.p == NULL) ? clients[i].req_deadline :
+					 clients[i].deadline;
+
+		wait = (d > now) ? (d - now + 999) / 1000 : 0;
+		if(wait < (uint64_t)ms)
+			ms = wait;
+	}
+
+	for(i = 0; i < n_clients; i++)	{
+		pfd[i].fd = clients[i].fd;
+		pfd[i].events = (clients[i].out.p == NULL) ? POLLIN : POLLOUT;
+		pfd[i].revents = 0;
+	}
+	n_fds = n_clients;
+	if(n_clients < STATS_CLIENTS)	{
+		listen_idx = n_fds;
+		pfd[n_fds].fd = stats_fd;
+		pfd[n_fds].events = POLLIN;
+		pfd[n_fds++].revents = 0;
+	}
+
+	if(poll(pfd, n_fds, ms) < 0)
+		return;
+
+	/* Backwards: dropping one moves the last (already seen) into its place */
+	now = monotonic_usec();
+	for(i = n_clients - 1; i >= 0; i--)
+		if(!serve_client(i, pfd[i].revents, now))
+			drop_client(i);
+	if(listen_idx >= 0 && (pfd[listen_idx].revents & POLLIN))
+		accept_clients(now);
+}
@@ -1,15 +1,24 @@
+/* accept4(), SO_REUSEPORT and TCP_DEFER_ACCEPT are Linux extensions */
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/types.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <assert.h>
+#include <stdbool.h>
 
 
 #include "util.h"
+#include "net.h"
 
 /**
  * Fill the @buf passed in with a human-readable IP-address of the @sa
@@ -49,16 +58,30 @@ static void get_ipaddr(char *buf, size_t len, struct sockaddr *sa)
         log_exit_perror(FATAL_ERROR, "inet_ntop");
 }
 
+/* Tuning is best-effort, a kernel without the option just doesn't get it */
+static void set_sockopt_int(int fd, int level, int opt, int val, const char *name)
+{
+	if(setsockopt(fd, level, opt, &val, sizeof(int)) == -1)
+		log_error("setsockopt %s=%d on fd=%d: %s", name, val, fd, strerror(errno));
+}
+
 /**
  * Create a listening socket bound to interface given by @node
  *
  * @local_port	The listening socket with a pending connection (via select())
  * @node		Nodename to bind to (localhost)
- * @return		The newly created file-descriptor
+ * @so			Listener settings: backlog (0 for the system maximum),
+ *				SO_REUSEPORT so several shards can listen on the port,
+ *				TCP_DEFER_ACCEPT seconds and TCP_FASTOPEN queue length, and
+ *				socket buffer sizes which accepted sockets inherit (any
+ *				zero is left at the system default)
+ * @return		The newly created file-descriptor, -1 if no address could be
+ *				bound (the port is taken), any other error is fatal
  *
  * NOTE: Much taken from the ridiculously useful http://beej.us/guide/bgnet/
  */
-int create_listen_socket(uint32_t local_port, const char *node)
+int create_listen_socket(uint32_t local_port, const char *node,
+						 const struct sock_opts *so)
 {
 	int sockfd;
 	struct addrinfo hints, *servinfo, *p;
@@ -87,6 +110,9 @@ int create_listen_socket(uint32_t local_port, const char *node)
 
 		if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1)
 			log_exit_perror(SOCKET_ERROR, "setsockopt for listen socket");
+		if (so->reuseport &&
+			setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) == -1)
+			log_exit_perror(SOCKET_ERROR, "SO_REUSEPORT for listen socket");
 
 		get_ipaddr(pstr, sizeof(pstr), p->ai_addr);
 		if (bind(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
@@ -101,30 +127,171 @@ int create_listen_socket(uint32_t local_port, const char *node)
 	freeaddrinfo(servinfo);
 
 	if (p == NULL)
-		log_exit(SOCKET_ERROR, "Failed to bind an address!");
+		return -1;
+
+	/* Clients that haven't sent anything yet don't cost a channel open */
+	if (so->defer_accept > 0)
+		set_sockopt_int(sockfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, so->defer_accept,
+						"TCP_DEFER_ACCEPT");
+	if (so->fastopen > 0)
+		set_sockopt_int(sockfd, IPPROTO_TCP, TCP_FASTOPEN, so->fastopen,
+						"TCP_FASTOPEN");
 
-	if (listen(sockfd, 10) < 0)
+	/* Set before listen() so the window scale offered to clients fits */
+	if (so->rcvbuf > 0)
+		set_sockopt_int(sockfd, SOL_SOCKET, SO_RCVBUF, so->rcvbuf, "SO_RCVBUF");
+	if (so->sndbuf > 0)
+		set_sockopt_int(sockfd, SOL_SOCKET, SO_SNDBUF, so->sndbuf, "SO_SNDBUF");
+
+	if (listen(sockfd, so->backlog > 0 ? so->backlog : SOMAXCONN) < 0)
 		log_exit_perror(SOCKET_ERROR, "listen new fd=%d", sockfd);
 
+	/* Pending connections are accepted in a loop until EAGAIN */
+	if (set_nonblocking(sockfd) < 0)
+		log_exit_perror(SOCKET_ERROR, "set O_NONBLOCK on fd=%d", sockfd);
+
 	return sockfd;
 }
 
+/**
+ * Hash the address (not the port) of the peer connected on @fd
+ *
+ * FNV-1a over the raw IPv4 or IPv6 address, so the same client host always
+ * hashes the same.
+ *
+ * @fd		connected socket
+ * @return	The hash, 0 if the peer can't be had
+ */
+uint32_t peer_addr_hash(int fd)
+{
+	struct sockaddr_storage sa;
+	socklen_t len = sizeof(sa);
+	const unsigned char *p;
+	uint32_t h = 2166136261u;
+	size_t i, n;
+
+	if(getpeername(fd, (struct sockaddr *)&sa, &len) < 0)
+		return 0;
+
+	switch(sa.ss_family)	{
+		case AF_INET:
+			p = (const unsigned char *)&((struct sockaddr_in *)&sa)->sin_addr;
+			n = sizeof(struct in_addr);
+			break;
+		case AF_INET6:
+			p = (const unsigned char *)&((struct sockaddr_in6 *)&sa)->sin6_addr;
+			n = sizeof(struct in6_addr);
+			break;
+		default:
+			return 0;
+	}
+	for(i = 0; i < n; i++)	{
+		h ^= p[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+int set_nonblocking(int fd)
+{
+	int flags;
+
+	if((flags = fcntl(fd, F_GETFL)) < 0)
+		return -1;
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/* Held open so that when we run out of descriptors there's still one to
+ * accept (and close) a connection with, instead of leaving it queued.  The
+ * workers share it: whoever takes it swaps in -1 first, so it's closed once. */
+static int spare_fd = -1;
+
+void reserve_spare_fd(void)
+{
+	int fd, none = -1;
+
+	if(__atomic_load_n(&spare_fd, __ATOMIC_ACQUIRE) >= 0)
+		return;
+	if((fd = open("/dev/null", O_RDONLY | O_CLOEXEC)) < 0)
+		return;
+	/* Another thread may have put one back meanwhile */
+	if(!__atomic_compare_exchange_n(&spare_fd, &none, fd, false,
+									__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		close(fd);
+}
+
+/* Out of descriptors: use the spare one to turn a client away cleanly */
+static int shed_connection(int listenfd)
+{
+	int fd = __atomic_exchange_n(&spare_fd, -1, __ATOMIC_ACQ_REL);
+
+	if(fd < 0)
+		return ACCEPT_FULL;
+
+	close(fd);
+	if((fd = accept(listenfd, NULL, NULL)) >= 0)
+		close(fd);
+	reserve_spare_fd();
+	return (fd >= 0) ? ACCEPT_SHED : ACCEPT_NONE;
+}
+
 /**
  * Small wrapper around accept() for user-connected sockets
  *
- * @listenfd	The listening socket with a pending connection (via select())
- * @return		The newly created file-descriptor
+ * The new socket comes back non-blocking already (accept4), all writes to
+ * it go through the connection's output queue so a slow client can't stall
+ * the loop.  The listener is non-blocking too, so this is called in a loop
+ * until nothing is pending.
+ *
+ * Running out of descriptors is not fatal: the connection is closed with
+ * the spare descriptor if we have it (ACCEPT_SHED), otherwise it stays
+ * queued and the caller should back off (ACCEPT_FULL).
+ *
+ * @listenfd	The listening socket with a pending connection (via epoll)
+ * @so			Per-connection settings: TCP_NODELAY, TCP_NOTSENT_LOWAT and
+ *				keepalive idle seconds (0 for off)
+ * @return		The newly created file-descriptor, or one of ACCEPT_NONE
+ *				(nothing pending), ACCEPT_SHED or ACCEPT_FULL
  */
-int accept_connection(int listenfd)
+int accept_connection(int listenfd, const struct sock_opts *so)
 {
 	struct sockaddr_storage their_addr;
 	socklen_t addr_size;
 	int new_fd;
 
     addr_size = sizeof their_addr;
-	new_fd = accept(listenfd, (struct sockaddr *)&their_addr, &addr_size);
-	if(new_fd < 0)
-		log_exit_perror(SOCKET_ERROR, "accept on socket fd=%d", listenfd);
+	new_fd = accept4(listenfd, (struct sockaddr *)&their_addr, &addr_size,
+					 SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if(new_fd < 0)	{
+		switch(errno)	{
+			/* Nothing left, or the client gave up while queued */
+			case EAGAIN:
+			case EINTR:
+			case ECONNABORTED:
+			case EPROTO:
+				return ACCEPT_NONE;
+			case EMFILE:
+			case ENFILE:
+				return shed_connection(listenfd);
+			case ENOBUFS:
+			case ENOMEM:
+				log_error("accept on socket fd=%d: %s", listenfd, strerror(errno));
+				return ACCEPT_FULL;
+			default:
+				log_exit_perror(SOCKET_ERROR, "accept on socket fd=%d", listenfd);
+		}
+	}
+
+	if(so->nodelay)
+		set_sockopt_int(new_fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+	if(so->notsent_lowat > 0)
+		set_sockopt_int(new_fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+						so->notsent_lowat, "TCP_NOTSENT_LOWAT");
+	if(so->keepalive > 0)	{
+		set_sockopt_int(new_fd, SOL_SOCKET, SO_KEEPALIVE, 1, "SO_KEEPALIVE");
+		set_sockopt_int(new_fd, IPPROTO_TCP, TCP_KEEPIDLE, so->keepalive,
+						"TCP_KEEPIDLE");
+	}
 
 	return new_fd;
 }
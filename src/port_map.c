@@ -6,6 +6,7 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <netdb.h>
+#include <math.h>
 
 
 #include "util.h"
@@ -13,86 +14,493 @@
 #include "autotun.h"
 #include "net.h"
 
+/* Bring the map's options into range for its kind of map */
+static void fix_map_opts(struct static_port_map *pm)
+{
+	if(pm->opts.max_read == 0 || pm->opts.max_read > CHAN_BUF_SIZE)
+		pm->opts.max_read = CHAN_BUF_SIZE;
+	else if(pm->opts.max_read < READ_SIZE_MIN)
+		pm->opts.max_read = READ_SIZE_MIN;
+
+	/* Held data is copied into one queue chunk so it's written in one go */
+	if(pm->opts.coalesce_bytes == 0)
+		pm->opts.coalesce_bytes = COALESCE_BYTES_DEFAULT;
+	else if(pm->opts.coalesce_bytes > BUFQ_CHUNK_SIZE)
+		pm->opts.coalesce_bytes = BUFQ_CHUNK_SIZE;
+
+	/* Nothing to pre-open when the destination comes from the client */
+	if(pm->dynamic && pm->opts.pool_size > 0)	{
+		log_msg("pool_size ignored for SOCKS map on port %d", pm->local_port);
+		pm->opts.pool_size = 0;
+	}
+	/* ...or when the backend depends on who the client is */
+	if(pm->opts.balance == BACKEND_SOURCE && pm->opts.pool_size > 0)	{
+		log_msg("pool_size ignored with balance=source on port %d",
+				pm->local_port);
+		pm->opts.pool_size = 0;
+	}
+
+	pm->opts.sock.reuseport = (pm->opts.shards > 1);
+}
+
+/* Append a copy of the configured destination @b to the map's backends */
+static void add_map_backend(struct static_port_map *pm, const struct backend *b)
+{
+	struct backend *be = safemalloc(sizeof(struct backend), "map backend");
+
+	be->host = safestrdup(b->host, "backend host");
+	be->port = b->port;
+	saferealloc((void **)&pm->be, (pm->n_be + 1) * sizeof(be),
+				"map backend array");
+	pm->be[pm->n_be++] = be;
+}
+
+/* The first backend stands for the map in messages */
+static void set_map_dest(struct static_port_map *pm, const struct backend *be,
+						 int n_be)
+{
+	free(pm->remote_host);
+	pm->dynamic = (n_be == 0);
+	pm->remote_host = safestrdup(pm->dynamic ? "socks" : be[0].host,
+								 "spm strdup hostname");
+	pm->remote_port = pm->dynamic ? 0 : be[0].port;
+}
+
 /**
  * Add a mapping (local port -> remote host + port) to the gateway structure.
  *
  * Creates a listening port for the local side and adds the fd to the fd_map
- * on the gateway that maps listening ports to the map structure.
+ * on the gateway that maps listening ports to the map structure, as well as
+ * to the gateway's event loop.
  *
  * The mappings are stored in an array of pointers gw->pm that is grown
  * appropriately and gw->n_maps stores the size of this array.
  *
  * @gw			gateway structure to add to
  * @local_port	the local port to listen on -- bound to localhost:NNNN
- * @host		the remote host to tunnel to
- * @remote_port	the port on the remote side to connect to
- * @return		Nothing, if anything fails here the program exits
+ * @be			the remote host(s) and port(s) to tunnel to, none for a
+ *				SOCKS map
+ * @n_be		number of entries in @be
+ * @opts		per-map options (pool size...)
+ * @return		The new map, its listen_fd is -1 if the port is taken
  */
-void add_map_to_gw(struct gw_host *gw,
-				  uint32_t local_port,
-				  char *host,
-				  uint32_t remote_port)
+struct static_port_map *add_map_to_gw(struct gw_host *gw,
+									  uint32_t local_port,
+									  const struct backend *be,
+									  int n_be,
+									  const struct map_opts *opts)
 {
 	struct static_port_map *spm;
-
-	debug("Adding map %d %s:%d to %s", local_port, host, remote_port, gw->name);
+	int i;
 
 	spm = safemalloc(sizeof(struct static_port_map), "static_port_map alloc");
 	spm->parent = gw;
 	spm->local_port = local_port;
-	spm->remote_host = safestrdup(host, "spm strdup hostname");
-	spm->remote_port = remote_port;
-	spm->ch = safemalloc(sizeof(struct chan_sock *), "spm->ch");
+	set_map_dest(spm, be, n_be);
+	for(i = 0; i < n_be; i++)
+		add_map_backend(spm, &be[i]);
+	spm->opts = *opts;
 
-	spm->listen_fd = create_listen_socket(local_port, gw->local ? "localhost" : "*");
-	add_fdmap(gw->listen_fdmap, spm->listen_fd, spm);
-	spm->parent = gw;
+	debug("Adding map %d %s:%d to %s%s", local_port, spm->remote_host,
+		  spm->remote_port, gw->name, n_be > 1 ? " (and other backends)" : "");
+
+	fix_map_opts(spm);
+	spm->ch = NULL;
+
+	/* Every map's traffic is sampled for the stats, only 'auto' acts on it */
+	spm->compress = (spm->opts.compression == COMP_ON);
+	spm->sample = safemalloc(sizeof(struct comp_sample), "compression sample");
+	spm->entropy = -1;
+
+	open_map_listener(spm);
 	spm->n_channels = 0;
+	spm->metrics = metrics_slot_new(gw->name, gw->shard, local_port);
 
 	saferealloc((void **)&gw->pm, (gw->n_maps + 1) * sizeof(spm), "gw->pm realloc");
 	gw->pm[gw->n_maps++] = spm;
+	return spm;
+}
+
+/* Bind the map's listening socket and watch it, false if the port is taken */
+bool open_map_listener(struct static_port_map *pm)
+{
+	struct gw_host *gw = pm->parent;
+
+	pm->listen_fd = create_listen_socket(pm->local_port,
+										 gw->local ? "localhost" : "*",
+										 &pm->opts.sock);
+	if(pm->listen_fd < 0)
+		return false;
+
+	add_fdmap(gw->listen_fdmap, pm->listen_fd, pm);
+	event_add(gw->ev, pm->listen_fd, EPOLLIN);
+	return true;
+}
+
+/* Stop listening for the map, clients already accepted aren't affected */
+void close_map_listener(struct static_port_map *pm)
+{
+	struct gw_host *gw = pm->parent;
+
+	if(pm->paused)	{
+		pm->paused = false;
+		gw->n_paused--;
+	}
+	if(pm->listen_fd < 0)
+		return;
+
+	remove_fdmap(gw->listen_fdmap, pm->listen_fd);
+	event_del(gw->ev, pm->listen_fd);
+	if(close(pm->listen_fd) < 0)
+		log_msg("Error closing listening fd=%d: %s", pm->listen_fd,
+				strerror(errno));
+	pm->listen_fd = -1;
+}
+
+/* The port is still held by someone else (a map on its way out, usually),
+ * the listener is retried with the paused ones until it can be bound */
+void retry_map_listener(struct static_port_map *pm)
+{
+	log_msg("Port %d is in use, will keep trying to listen on it",
+			pm->local_port);
+	pm->resume_at = monotonic_usec() + LISTEN_RETRY_USEC;
+	if(!pm->paused)	{
+		pm->paused = true;
+		pm->parent->n_paused++;
+	}
+}
+
+/* Create the ssh_channel for @cs on @sess and hook it up to the gateway */
+static int bind_channel(struct chan_sock *cs, struct gw_session *sess)
+{
+	struct gw_host *gw = cs->parent->parent;
+
+	if((cs->channel = ssh_channel_new(sess->session)) == NULL)
+		return -1;
+
+	cs->sess = sess;
+	sess->n_channels++;
+	add_ptrmap(gw->chan_map, cs->channel, cs);
+	ssh_set_channel_callbacks(cs->channel, &gw->chan_cb);
+	return 0;
+}
+
+/* Drop the ssh_channel of @cs (if it has one), the chan_sock itself stays */
+static void unbind_channel(struct chan_sock *cs)
+{
+	unmark_channel_ready(cs);
+	if(cs->channel == NULL)
+		return;
+	remove_ptrmap(cs->parent->parent->chan_map, cs->channel);
+
+	/* Nothing can be sent on a session that died */
+	if( cs->sess->state == SESS_UP && ssh_channel_is_open(cs->channel) &&
+		ssh_channel_close(cs->channel) != SSH_OK)
+			log_error("Error on channel close for %s", cs->parent->parent->name);
+	ssh_channel_free(cs->channel);
+	cs->channel = NULL;
+	cs->sess->n_channels--;
+	cs->sess = NULL;
+}
+
+/* Take the channel away from a connection that will be queued again */
+void release_channel(struct chan_sock *cs)
+{
+	unbind_channel(cs);
+}
+
+/**
+ * Create the chan_sock for a new channel on a mapping, not yet tied to a client
+ *
+ * The channel is created on the session @sess and entered in the gateway's
+ * hash that maps the ssh_channel back to it, and the gateway's channel
+ * callbacks are attached so that incoming data puts the channel on the
+ * gateway's ready list.  Pooled channels stay like this until a client is
+ * attached with attach_client().
+ *
+ * Without a session the connection has no channel yet, it gets one with
+ * move_channel_to_session() once a session is up to open it on.
+ *
+ * @pm		mapping the channel belongs to
+ * @sess	gateway session to open the channel on, may be NULL
+ * @return	Pointer to newly created channel struct, NULL if libssh can't
+ *			create the channel
+ */
+struct chan_sock *new_chan_sock(struct static_port_map *pm,
+							   struct gw_session *sess)
+{
+	struct chan_sock *cs = safemalloc(sizeof(struct chan_sock), "add ch cs");
+
+	cs->sock_fd = -1;
+	cs->parent = pm;
+	cs->state = CS_QUEUED;
+	cs->events = EPOLLIN;
+	cs->rd_size = cs->chan_rd_size =
+		(pm->opts.max_read < READ_SIZE_INIT) ? pm->opts.max_read : READ_SIZE_INIT;
+	init_bufq(&cs->outq);
+	init_bufq(&cs->inq);
+
+	if(sess != NULL && bind_channel(cs, sess) < 0)	{
+		free(cs);
+		return NULL;
+	}
+	return cs;
+}
+
+/**
+ * Give @cs a fresh channel on @sess, replacing any it had
+ *
+ * Used when a queued connection's open is about to start, or when a session
+ * refused the open: the connection keeps its client and anything buffered,
+ * only the (failed, unopened) channel is swapped.
+ *
+ * @cs		connection to (re)bind
+ * @sess	session to open the channel on
+ * @return	0 on success, -1 if the new channel can't be created
+ */
+int move_channel_to_session(struct chan_sock *cs, struct gw_session *sess)
+{
+	if(cs->channel != NULL)
+		unbind_channel(cs);
+	return bind_channel(cs, sess);
+}
+
+/**
+ * Tie a client socket to the channel and add it to the map's channel list
+ *
+ * Updates the fd_map in the gateway (pm->parent) that maps connection socket
+ * fd to the channel structure and starts watching the socket.
+ *
+ * Channels hang off the map in a doubly-linked list, so adding and removing
+ * them is constant time and the chan_sock pointer stays valid for the whole
+ * life of the connection.
+ *
+ * @cs		the channel
+ * @sock_fd	socket that the client is connected on
+ */
+void attach_client(struct chan_sock *cs, int sock_fd)
+{
+	struct static_port_map *pm = cs->parent;
+	struct gw_host *gw = pm->parent;
+
+	cs->sock_fd = sock_fd;
+	cs->prev = NULL;
+	cs->next = pm->ch;
+	if(pm->ch != NULL)
+		pm->ch->prev = cs;
+	pm->ch = cs;
+	pm->n_channels++;
+	gw->n_conns++;
+	metric_set(&pm->metrics->c.n_active, pm->n_channels);
+
+	add_fdmap(gw->chan_sock_fdmap, sock_fd, cs);
+	event_add(gw->ev, sock_fd, cs->events);
 }
 
 /**
  * Add a new channel to a specific remote-host mapping
  *
- * Creates a new channel in the mapping and returns a pointer to it, updating
- * the fd_map in the gateway (pm->parent) that maps connection socket fd to
- * the new channel structure.
+ * Creates a new channel in the mapping and returns a pointer to it, see
+ * new_chan_sock() and attach_client().
  *
  * @pm		mapping to add a new channel to
- * @channel	newly created ssh_channel
+ * @sess	gateway session to open the channel on, NULL to pick one later
  * @sock_fd	socket that the client is connected on
- * @return	Pointer to newly created channel struct
+ * @return	Pointer to newly created channel struct, NULL on failure
  */
 struct chan_sock *
 add_channel_to_map(struct static_port_map *pm,
-				   ssh_channel channel,
+				   struct gw_session *sess,
 				   int sock_fd)
 {
-	struct chan_sock *cs = safemalloc(sizeof(struct chan_sock), "add ch cs");
+	struct chan_sock *cs;
 
-	debug("Adding channel %p to map %s:%d", channel, pm->remote_host, pm->remote_port);
-	saferealloc((void **)&pm->ch, (pm->n_channels + 1) * sizeof(pm->ch),
-				"pm->channel realloc");
-	cs->channel = channel;
-	cs->sock_fd = sock_fd;
-	add_fdmap(pm->parent->chan_sock_fdmap, sock_fd, cs);
-	pm->ch[pm->n_channels] = cs;
-	pm->n_channels++;
-	cs->parent = pm;
+	if((cs = new_chan_sock(pm, sess)) == NULL)
+		return NULL;
+	debug("Adding channel %p to map %s:%d", cs->channel, pm->remote_host, pm->remote_port);
+	attach_client(cs, sock_fd);
 	return cs;
 }
 
+/* Constant time lookup of the chan_sock owning the ssh_channel @ch */
+struct chan_sock *get_cs_for_channel(struct gw_host *gw, ssh_channel ch)
+{
+	return get_ptrmap(gw->chan_map, ch);
+}
+
+/**
+ * Put the channel on its gateway's list of channels with pending input
+ *
+ * Called from the libssh channel callbacks, the main loop drains this list
+ * instead of polling every channel.  Already-ready channels are left alone.
+ */
+void mark_channel_ready(struct chan_sock *cs)
+{
+	struct gw_host *gw = cs->parent->parent;
+
+	if(cs->ready)
+		return;
+
+	cs->ready = true;
+	cs->ready_prev = NULL;
+	cs->ready_next = gw->ready;
+	if(gw->ready != NULL)
+		gw->ready->ready_prev = cs;
+	gw->ready = cs;
+}
+
+void unmark_channel_ready(struct chan_sock *cs)
+{
+	struct gw_host *gw = cs->parent->parent;
+
+	if(!cs->ready)
+		return;
+
+	if(cs->ready_prev != NULL)
+		cs->ready_prev->ready_next = cs->ready_next;
+	else
+		gw->ready = cs->ready_next;
+	if(cs->ready_next != NULL)
+		cs->ready_next->ready_prev = cs->ready_prev;
+	cs->ready = false;
+}
+
+/**
+ * Hold the connection's client data back to gather more, see
+ * process_coalesced().  Already coalescing connections keep their deadline.
+ *
+ * @cs			connection with small client data in its input queue
+ * @flush_at	monotonic time by which the data has to go out
+ */
+void start_coalescing(struct chan_sock *cs, uint64_t flush_at)
+{
+	struct gw_host *gw = cs->parent->parent;
+
+	if(cs->coalescing)
+		return;
+
+	cs->coalescing = true;
+	cs->flush_at = flush_at;
+	cs->co_prev = NULL;
+	cs->co_next = gw->coalescing;
+	if(gw->coalescing != NULL)
+		gw->coalescing->co_prev = cs;
+	gw->coalescing = cs;
+}
+
+void stop_coalescing(struct chan_sock *cs)
+{
+	struct gw_host *gw = cs->parent->parent;
+
+	if(!cs->coalescing)
+		return;
+
+	if(cs->co_prev != NULL)
+		cs->co_prev->co_next = cs->co_next;
+	else
+		gw->coalescing = cs->co_next;
+	if(cs->co_next != NULL)
+		cs->co_next->co_prev = cs->co_prev;
+	cs->coalescing = false;
+}
+
+/**
+ * Set which events the loop waits for on the client socket
+ *
+ * We want to hear about input unless the channel can't take any more (its
+ * remote window is used up), and about writability only while there is
+ * queued output for the client.
+ */
+void update_chan_events(struct chan_sock *cs)
+{
+	uint32_t want = 0;
+
+	if(!cs->rd_blocked)
+		want |= EPOLLIN;
+	if(cs->outq.bytes > 0)
+		want |= EPOLLOUT;
+
+	if(want != cs->events)	{
+		event_mod(cs->parent->parent->ev, cs->sock_fd, want);
+		cs->events = want;
+	}
+}
+
+void append_cs_list(struct cs_list *l, struct chan_sock *cs)
+{
+	cs->open_next = NULL;
+	cs->open_prev = l->tail;
+	if(l->tail != NULL)
+		l->tail->open_next = cs;
+	else
+		l->head = cs;
+	l->tail = cs;
+	l->n++;
+}
+
+void remove_cs_list(struct cs_list *l, struct chan_sock *cs)
+{
+	if(cs->open_prev != NULL)
+		cs->open_prev->open_next = cs->open_next;
+	else
+		l->head = cs->open_next;
+	if(cs->open_next != NULL)
+		cs->open_next->open_prev = cs->open_prev;
+	else
+		l->tail = cs->open_prev;
+	cs->open_next = cs->open_prev = NULL;
+	l->n--;
+}
+
+/* Close the ssh side of a connection and release it */
+void free_channel(struct chan_sock *cs)
+{
+	stop_coalescing(cs);
+	unbind_channel(cs);
+
+	drop_backend(cs);
+
+	clear_bufq(&cs->outq);
+	clear_bufq(&cs->inq);
+	free(cs->socks);
+	free(cs->dest_host);
+	free(cs);
+}
+
+/**
+ * Drop a pooled channel that never got a client
+ *
+ * Ready ones come off the map's pool, ones still opening are abandoned the
+ * same way remove_channel_from_map() does it.
+ *
+ * @cs		pooled channel to drop
+ */
+void remove_pooled_channel(struct chan_sock *cs)
+{
+	struct static_port_map *pm = cs->parent;
+
+	if(cs->state == CS_OPENING)	{
+		remove_ptrmap(pm->parent->chan_map, cs->channel);
+		unmark_channel_ready(cs);
+		cs->abandoned = true;
+		return;
+	}
+	remove_cs_list(&pm->pool, cs);
+	free_channel(cs);
+}
+
 /**
  * Remove a channel from its associated port mapping structure
  *
  * Take the channel given and remove it from its parent port_map structure,
  * closing it first and removing it from the fd_map in the gateway struct that
- * maps client sockets -> channels.
+ * maps client sockets -> channels, as well as from the channel hash and the
+ * ready list.  Unlinking from the map's channel list is constant time.
  *
- * All channel pointers in pm->ch[] higher than this one are shifted down by
- * one position and the array is shrunk appropriately.
+ * A channel whose open request is still in flight can't be freed yet, the
+ * gateway would answer for a channel libssh no longer knows.  Its client is
+ * closed and it is left on the gateway's opening list, marked abandoned, to
+ * be closed and freed once the answer comes in.
  *
  * @cs		channel structure to remove
  * @return	Nothing, if there are errors here they are either logged or the
@@ -101,40 +509,54 @@ add_channel_to_map(struct static_port_map *pm,
 void remove_channel_from_map(struct chan_sock *cs)
 {
 	struct static_port_map *pm = cs->parent;
-	int i;
+	struct gw_host *gw;
 
 	if(cs->parent == NULL)
 		log_exit(FATAL_ERROR, "Corrupt chan_sock parent %p->parent NULL", cs);
 
-	for(i = 0; i < pm->n_channels; i++)	{
-		if(pm->ch[i] == cs)	{
-			if( ssh_channel_is_open(cs->channel) &&
-				ssh_channel_close(cs->channel) != SSH_OK)
-					log_msg("Error on channel close for %s", pm->parent->name);
-			ssh_channel_free(cs->channel);
-			break;
-		}
-	}
+	gw = pm->parent;
 
-	debug("Destroy channel %p, closing fd=%d", cs->channel, cs->sock_fd);
-	for(; i < pm->n_channels - 1; i++)
-		pm->ch[i] = pm->ch[i + 1];
+	/* Out of the hash first so callbacks fired while closing can't find it */
+	if(cs->channel != NULL)
+		remove_ptrmap(gw->chan_map, cs->channel);
+	unmark_channel_ready(cs);
 
-	saferealloc((void **)&pm->ch, pm->n_channels * sizeof(cs),
-				"pm->channel realloc");
+	if(cs->prev != NULL)
+		cs->prev->next = cs->next;
+	else
+		pm->ch = cs->next;
+	if(cs->next != NULL)
+		cs->next->prev = cs->prev;
 	pm->n_channels -= 1;
+	gw->n_conns--;
+	metric_set(&pm->metrics->c.n_active, pm->n_channels);
+
+	debug("Destroy channel %p, closing fd=%d", cs->channel, cs->sock_fd);
+	event_del(gw->ev, cs->sock_fd);
 	close(cs->sock_fd);
 
 	/* Remove this fd from parent gw's fd_map */
-	remove_fdmap(pm->parent->chan_sock_fdmap, cs->sock_fd);
-	free(cs);
+	remove_fdmap(gw->chan_sock_fdmap, cs->sock_fd);
+
+	switch(cs->state)	{
+		case CS_QUEUED:
+			remove_cs_list(&gw->open_queue, cs);
+			break;
+		case CS_OPENING:
+			cs->abandoned = true;
+			return;
+		default:
+			break;
+	}
+	free_channel(cs);
 }
 
 /**
  * Free the map structure and destroy all connected channels
  *
- * The removal of channels is done by remove_channel_from_map(), and then
- * the listenening file-descriptor is closed and removed from the fd_map
+ * The removal of channels is done by remove_channel_from_map(), any opens
+ * still outstanding for the map are dropped, and then the listenening
+ * file-descriptor is closed and removed from the fd_map
  *
  * @pm		the map to destroy
  * @return	Nothing, any errors encountered are fatal
@@ -142,42 +564,220 @@ void remove_channel_from_map(struct chan_sock *cs)
  */
 static void free_map(struct static_port_map *pm)
 {
+	struct gw_host *gw = pm->parent;
+	struct chan_sock *cs, *next;
+	int i;
+
 	debug("Freeing map %p (listen on %d) %d channels", pm, pm->local_port, pm->n_channels);
 
-	while(pm->n_channels)
-		remove_channel_from_map(pm->ch[0]);
+	while(pm->ch != NULL)
+		remove_channel_from_map(pm->ch);
+	while(pm->pool.head != NULL)
+		remove_pooled_channel(pm->pool.head);
 
-	remove_fdmap(pm->parent->listen_fdmap, pm->listen_fd);
-	if(close(pm->listen_fd) < 0)
-		log_msg("Error closing listening fd=%d: %s", pm->listen_fd,
-				strerror(errno));
-	free(pm->ch);
+	/* Opens still in flight for this map won't have anywhere to go */
+	for(cs = gw->opening.head; cs != NULL; cs = next)	{
+		next = cs->open_next;
+		if(cs->parent == pm)	{
+			remove_cs_list(&gw->opening, cs);
+			free_channel(cs);
+		}
+	}
+
+	for(i = 0; i < pm->n_be; i++)	{
+		if(pm->be[i]->down)
+			gw->n_be_down--;
+		free(pm->be[i]->host);
+		free(pm->be[i]);
+	}
+	free(pm->be);
+
+	metrics_slot_free(pm->metrics, gw->metrics);
+	free(pm->sample);
+	close_map_listener(pm);
 	free(pm->remote_host);
 	free(pm);
 }
 
+/* Backends still configured for the map, removed ones are only kept for the
+ * connections that went to them */
+static int live_backends(const struct static_port_map *pm)
+{
+	int i, n = 0;
+
+	for(i = 0; i < pm->n_be; i++)
+		if(!pm->be[i]->removed)
+			n++;
+	return n;
+}
+
+/* A down backend is still used when all of them are, it may be back before
+ * a probe has found out and failing the client is no better */
+static bool in_rotation(const struct backend *be, bool all_down)
+{
+	return !be->removed && (!be->down || all_down);
+}
+
+/**
+ * Choose the backend for a new connection on @pm
+ *
+ * leastconn takes the one with the fewest connections, ties going round in
+ * turn, rr just goes round, and source hashes the client's address so a
+ * client sticks to one backend (for as long as the same ones are up).
+ *
+ * @pm		map with at least one live backend
+ * @hash	hash of the client's address, for BACKEND_SOURCE
+ * @return	The backend to use
+ */
+static struct backend *pick_backend(struct static_port_map *pm, uint32_t hash)
+{
+	bool all_down = (pm->n_down == live_backends(pm));
+	struct backend *be, *best = NULL;
+	int i, j, n = 0;
+
+	if(pm->opts.balance == BACKEND_SOURCE)	{
+		for(i = 0; i < pm->n_be; i++)
+			if(in_rotation(pm->be[i], all_down))
+				n++;
+		n = hash % n;
+		for(i = 0; i < pm->n_be; i++)
+			if(in_rotation(pm->be[i], all_down) && n-- == 0)
+				break;
+		return pm->be[i];
+	}
+
+	for(j = 0; j < pm->n_be; j++)	{
+		i = (pm->be_next + j) % pm->n_be;
+		be = pm->be[i];
+		if(!in_rotation(be, all_down))
+			continue;
+		if(best == NULL || be->n_channels < best->n_channels)	{
+			best = be;
+			n = i;
+		}
+		if(pm->opts.balance == BACKEND_RR)
+			break;
+	}
+	pm->be_next = (n + 1) % pm->n_be;
+	return best;
+}
+
+/* Send @cs to @be, it counts against the backend until it's freed */
+void use_backend(struct chan_sock *cs, struct backend *be)
+{
+	cs->be = be;
+	be->n_channels++;
+	if(cs->probe)
+		be->probing = true;
+}
+
+/* Forget @cs's backend, a new one is picked if it's opened again */
+void drop_backend(struct chan_sock *cs)
+{
+	if(cs->be == NULL)
+		return;
+	cs->be->n_channels--;
+	if(cs->probe)
+		cs->be->probing = false;
+	cs->be = NULL;
+}
+
+/* An open to @cs's backend got through, if it was down it's back */
+void backend_opened(struct chan_sock *cs)
+{
+	struct static_port_map *pm = cs->parent;
+	struct backend *be = cs->be;
+
+	be->n_opened++;
+	if(!be->down)
+		return;
+
+	log_msg("Backend %s:%d of map %d is back in rotation", be->host, be->port,
+			pm->local_port);
+	be->down = false;
+	pm->n_down--;
+	pm->parent->n_be_down--;
+}
+
 /**
- * Open a libssh forwarding channel for the given channel socket/channel pair
+ * The gateway couldn't open a channel to @cs's backend
  *
- * Try to open a forwarding channel and if it fails, remove the chan_sock
- * attribute from the pm.
+ * If the map has other backends this one is taken out of rotation, the
+ * gateway loop tries it again every BACKEND_PROBE_USEC with a probe open
+ * and puts it back once one gets through.
  *
- * @cs		the map to destroy
- * @return	0 if OK, -1 on error
+ * @cs		connection (or pool or probe channel) whose open failed
+ */
+void backend_failed(struct chan_sock *cs)
+{
+	struct static_port_map *pm = cs->parent;
+	struct backend *be = cs->be;
+
+	be->n_failed++;
+	be->probe_at = monotonic_usec() + BACKEND_PROBE_USEC;
+	if(be->down || be->removed || live_backends(pm) < 2)
+		return;
+
+	log_msg("Backend %s:%d of map %d is down, taking it out of rotation",
+			be->host, be->port, pm->local_port);
+	be->down = true;
+	pm->n_down++;
+	pm->parent->n_be_down++;
+}
+
+/* Is there a backend other than @be up, for a failed open to try instead? */
+bool other_backend_up(struct static_port_map *pm, struct backend *be)
+{
+	int i;
+
+	for(i = 0; i < pm->n_be; i++)
+		if(pm->be[i] != be && in_rotation(pm->be[i], false))
+			return true;
+	return false;
+}
+
+/**
+ * Open (or continue opening) the libssh forwarding channel for @cs
+ *
+ * The session is non-blocking, so this only sends the open request the first
+ * time and returns, the main loop calls it again until the gateway answers.
+ * Many channels can be opening at once this way.
+ *
+ * Connections on a SOCKS map go where the client asked, hostnames are passed
+ * along as-is so the gateway resolves them.  Other connections go to one of
+ * the map's backends, picked the first time.
+ *
+ * @cs		the connection whose channel to open
+ * @return	1 if the channel is open, 0 if still pending, -1 on error
  */
 int connect_forward_channel(struct chan_sock *cs)
 {
 	struct static_port_map *pm = cs->parent;
-	int rc;
-	rc = ssh_channel_open_forward(cs->channel, pm->remote_host,
-								  pm->remote_port, "localhost", pm->local_port);
-	if(rc != SSH_OK)	{
-		log_msg("Error: error opening forward %d -> %s:%d", pm->local_port,
-				pm->remote_host, pm->remote_port);
-		remove_channel_from_map(cs);
-		return -1;
+	const char *host;
+	uint32_t port;
+
+	if(cs->dest_host != NULL)	{
+		host = cs->dest_host;
+		port = cs->dest_port;
+	} else {
+		if(cs->be == NULL)
+			use_backend(cs, pick_backend(pm, cs->src_hash));
+		host = cs->be->host;
+		port = cs->be->port;
+	}
+
+	switch(ssh_channel_open_forward(cs->channel, host, port, "localhost",
+									pm->local_port))	{
+		case SSH_OK:
+			return 1;
+		case SSH_AGAIN:
+			return 0;
+		default:
+			log_error("Error: error opening forward %d -> %s:%d: %s",
+					pm->local_port, host, port,
+					ssh_get_error(cs->sess->session));
+			return -1;
 	}
-	return 0;
 }
 
 /**
@@ -212,3 +812,191 @@ void remove_map_from_gw(struct static_port_map *map)
 		free_map(map);
 	}
 }
+
+/**
+ * Count the bytes of a map's traffic until there's enough to judge it
+ *
+ * Once COMP_SAMPLE_BYTES have been seen the order-0 entropy of the sample
+ * is worked out.  An 'auto' map whose data looks compressible moves its new
+ * channels over to the gateway's compressed sessions, anything already
+ * compressed or encrypted stays on the plain ones.
+ *
+ * @pm		map the data belongs to
+ * @data	bytes sent either way on one of the map's connections
+ * @len		number of bytes
+ */
+void sample_map_traffic(struct static_port_map *pm, const char *data, size_t len)
+{
+	struct comp_sample *smp = pm->sample;
+	double p, h = 0;
+	size_t i;
+
+	if(smp == NULL)
+		return;
+
+	for(i = 0; i < len && smp->n < COMP_SAMPLE_BYTES; i++, smp->n++)
+		smp->count[(unsigned char)data[i]]++;
+
+	if(smp->n < COMP_SAMPLE_BYTES)
+		return;
+
+	for(i = 0; i < 256; i++)	{
+		if(smp->count[i] == 0)
+			continue;
+		p = (double)smp->count[i] / smp->n;
+		h -= p * log2(p);
+	}
+	pm->entropy = h;
+	free(smp);
+	pm->sample = NULL;
+
+	if(pm->opts.compression == COMP_AUTO)
+		pm->compress = (h < COMP_ENTROPY_MAX);
+	debug("Map %d traffic entropy %.2f bits/byte%s", pm->local_port, h,
+		  pm->opts.compression != COMP_AUTO ? "" :
+		  (pm->compress ? ", compressing" : ", not compressing"));
+}
+
+/* Drop the map's warm channels, and the pool opens still in flight */
+static void drop_map_pool(struct static_port_map *pm)
+{
+	struct chan_sock *cs;
+
+	while(pm->pool.head != NULL)
+		remove_pooled_channel(pm->pool.head);
+
+	for(cs = pm->parent->opening.head; cs != NULL; cs = cs->open_next)
+		if(cs->parent == pm && cs->pooled && !cs->abandoned)
+			remove_pooled_channel(cs);
+}
+
+/**
+ * Take a map out of service, its open connections carry on
+ *
+ * The listener is closed right away so the port is free for whatever
+ * replaces the map, the map itself is removed once its last connection is
+ * gone (see the gateway loop).
+ *
+ * @pm		map that is no longer configured
+ */
+void drain_map(struct static_port_map *pm)
+{
+	if(pm->draining)
+		return;
+
+	log_msg("Draining map %d -> %s:%d, %d connections left", pm->local_port,
+			pm->remote_host, pm->remote_port, pm->n_channels);
+	close_map_listener(pm);
+	drop_map_pool(pm);
+	pm->draining = true;
+}
+
+/* Listener settings that only take effect on a new socket */
+static bool same_listener(const struct sock_opts *a, const struct sock_opts *b)
+{
+	return a->backlog == b->backlog && a->reuseport == b->reuseport &&
+		   a->defer_accept == b->defer_accept && a->fastopen == b->fastopen &&
+		   a->rcvbuf == b->rcvbuf && a->sndbuf == b->sndbuf;
+}
+
+/* Are the map's live backends @be, in that order? */
+static bool same_backends(const struct static_port_map *pm,
+						  const struct backend *be, int n_be)
+{
+	int i, k = 0;
+
+	for(i = 0; i < pm->n_be; i++)	{
+		if(pm->be[i]->removed)
+			continue;
+		if(k == n_be || pm->be[i]->port != be[k].port ||
+		   strcmp(pm->be[i]->host, be[k].host) != 0)
+			return false;
+		k++;
+	}
+	return k == n_be;
+}
+
+/**
+ * Switch the map over to the backends @be
+ *
+ * The old backends are marked removed rather than freed, connections may
+ * still point at them, and any that is configured again is brought back
+ * (with a clean slate, it's tried again even if it was down).
+ */
+static void replace_backends(struct static_port_map *pm,
+							 const struct backend *be, int n_be)
+{
+	int i, k;
+
+	for(i = 0; i < pm->n_be; i++)	{
+		if(pm->be[i]->down)	{
+			pm->be[i]->down = false;
+			pm->n_down--;
+			pm->parent->n_be_down--;
+		}
+		pm->be[i]->removed = true;
+	}
+
+	for(k = 0; k < n_be; k++)	{
+		for(i = 0; i < pm->n_be; i++)
+			if(pm->be[i]->port == be[k].port &&
+			   strcmp(pm->be[i]->host, be[k].host) == 0)
+				break;
+		if(i < pm->n_be)
+			pm->be[i]->removed = false;
+		else
+			add_map_backend(pm, &be[k]);
+	}
+	set_map_dest(pm, be, n_be);
+}
+
+/**
+ * Give a running map the settings from a re-read config
+ *
+ * Connections already open keep going where they went, new ones get the
+ * new destinations and options.  Warm pool channels are dropped when the
+ * destinations change.  A change to the listener's own settings means a
+ * new socket, clients still in the old one's backlog are reset.
+ *
+ * @pm			map to update, matched on its local port
+ * @be			remote host(s) and port(s), none for a SOCKS map
+ * @n_be		number of entries in @be
+ * @opts		the map's options as configured
+ */
+void update_map(struct static_port_map *pm, const struct backend *be, int n_be,
+				const struct map_opts *opts)
+{
+	struct sock_opts old_sock = pm->opts.sock;
+
+	if((n_be == 0) != pm->dynamic || !same_backends(pm, be, n_be))	{
+		log_msg("Map %d now goes to %s:%d%s", pm->local_port,
+				n_be == 0 ? "socks" : be[0].host, n_be == 0 ? 0 : be[0].port,
+				n_be > 1 ? " and other backends" : "");
+		drop_map_pool(pm);
+		replace_backends(pm, be, n_be);
+	}
+
+	/* Switching to 'auto' starts a fresh sample */
+	if(opts->compression == COMP_AUTO && pm->opts.compression != COMP_AUTO)	{
+		if(pm->sample == NULL)
+			pm->sample = safemalloc(sizeof(struct comp_sample),
+									"compression sample");
+		memset(pm->sample, 0, sizeof(struct comp_sample));
+		pm->entropy = -1;
+		pm->compress = false;
+	} else if(opts->compression != COMP_AUTO) {
+		pm->compress = (opts->compression == COMP_ON);
+	}
+
+	pm->opts = *opts;
+	fix_map_opts(pm);
+	pm->parent->pool_short = true;
+
+	if(!same_listener(&old_sock, &pm->opts.sock))	{
+		debug("Listener settings for port %d changed, reopening it",
+			  pm->local_port);
+		close_map_listener(pm);
+		if(!open_map_listener(pm))
+			retry_map_listener(pm);
+	}
+}
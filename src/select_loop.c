@@ -8,13 +8,27 @@
 #include "autotun.h"
 #include "port_map.h"
 #include "net.h"
+#include "stats.h"
+#include "socks.h"
+#include "ssh.h"
 
-bool finish_main_loop = false;
-bool hard_shutdown = false;
+volatile sig_atomic_t finish_main_loop = false;
+volatile sig_atomic_t hard_shutdown = false;
+volatile sig_atomic_t reload_config = false;
+
+/* Shutting down, or the gateway was dropped from the config (by the worker
+ * running it, but the main thread looks too, see have_gw()) */
+static inline bool gw_finishing(struct gw_host *gw)
+{
+	return __atomic_load_n(&finish_main_loop, __ATOMIC_RELAXED) ||
+		   __atomic_load_n(&gw->draining, __ATOMIC_RELAXED);
+}
 
 static struct static_port_map *
 get_map_for_listening(struct gw_host *gw, int listen_fd)
 {
+	if(listen_fd >= gw->listen_fdmap->len)
+		return NULL;
 	return get_fdmap(gw->listen_fdmap, listen_fd);
 }
 
@@ -24,261 +38,1786 @@ get_chan_for_fd(struct gw_host *gw, int fd)
 	return get_fdmap(gw->chan_sock_fdmap, fd);
 }
 
-static struct chan_sock *
-get_cs_for_channel(struct gw_host *gw, ssh_channel ch)
+static struct gw_session *
+get_session_for_fd(struct gw_host *gw, int fd)
+{
+	if(fd >= gw->sess_fdmap->len)
+		return NULL;
+	return get_fdmap(gw->sess_fdmap, fd);
+}
+
+/* libssh callbacks, data is left in the channel buffer for the main loop */
+static int channel_data_cb(ssh_session session, ssh_channel ch, void *data,
+						   uint32_t len, int is_stderr, void *userdata)
+{
+	struct chan_sock *cs = get_cs_for_channel(userdata, ch);
+
+	if(cs != NULL)
+		mark_channel_ready(cs);
+	return 0;
+}
+
+static void channel_eof_cb(ssh_session session, ssh_channel ch, void *userdata)
+{
+	struct chan_sock *cs = get_cs_for_channel(userdata, ch);
+
+	if(cs != NULL)
+		mark_channel_ready(cs);
+}
+
+/* Remote window opened up (or the session socket drained), resume input */
+static int channel_wontblock_cb(ssh_session session, ssh_channel ch,
+								uint32_t bytes, void *userdata)
+{
+	struct chan_sock *cs = get_cs_for_channel(userdata, ch);
+
+	if(cs != NULL && cs->rd_blocked)
+		mark_channel_ready(cs);
+	return 0;
+}
+
+static void setup_channel_callbacks(struct gw_host *gw)
+{
+	memset(&gw->chan_cb, 0, sizeof(gw->chan_cb));
+	gw->chan_cb.userdata = gw;
+	gw->chan_cb.channel_data_function = channel_data_cb;
+	gw->chan_cb.channel_eof_function = channel_eof_cb;
+	gw->chan_cb.channel_close_function = channel_eof_cb;
+	gw->chan_cb.channel_write_wontblock_function = channel_wontblock_cb;
+	ssh_callbacks_init(&gw->chan_cb);
+}
+
+/* Connections are torn down at the end of each pass through the loop */
+static void close_later(struct gw_host *gw, struct chan_sock *cs)
+{
+	if(cs->closing)
+		return;
+
+	cs->closing = true;
+	saferealloc((void **)&gw->closing,
+				(gw->n_closing + 1) * sizeof(struct chan_sock *),
+				"removed channels");
+	gw->closing[gw->n_closing++] = cs;
+}
+
+static void remove_closed_channels(struct gw_host *gw)
+{
+	int i;
+
+	for(i = 0; i < gw->n_closing; i++)
+		remove_channel_from_map(gw->closing[i]);
+	free(gw->closing);
+	gw->closing = NULL;
+	gw->n_closing = 0;
+}
+
+/* Watch the socket of a session that is being set up, nothing may block */
+static void watch_session(struct gw_host *gw, struct gw_session *s)
+{
+	s->events = EPOLLIN;
+	add_fdmap(gw->sess_fdmap, s->fd, s);
+	event_add(gw->ev, s->fd, s->events);
+}
+
+static void unwatch_session(struct gw_host *gw, struct gw_session *s)
+{
+	if(s->fd < 0)
+		return;
+	event_del(gw->ev, s->fd);
+	remove_fdmap(gw->sess_fdmap, s->fd);
+	s->fd = -1;
+	if(s->ssh_ev != NULL)	{
+		ssh_event_remove_session(s->ssh_ev, s->session);
+		ssh_event_free(s->ssh_ev);
+		s->ssh_ev = NULL;
+	}
+}
+
+/* Authenticated, from here on libssh reads the socket through ssh_ev */
+static void session_up(struct gw_host *gw, struct gw_session *s)
+{
+	struct gw_member *m = s->member;
+
+	if((s->ssh_ev = ssh_event_new()) == NULL ||
+	   ssh_event_add_session(s->ssh_ev, s->session) != SSH_OK)
+		log_exit(FATAL_ERROR, "Error creating ssh event for %s", gw->name);
+
+	if(m->backoff_usec > 0)
+		log_msg("Reconnected to %s", m->host);
+	/* The first probe goes right away, rtt balancing needs its answer */
+	s->ka_next = (gw->balance == BALANCE_RTT) ? monotonic_usec() :
+				 monotonic_usec() + gw->keepalive_usec;
+	m->backoff_usec = 0;
+	m->reconnect[s->compressed] = false;
+	gw->pool_short = true;
+}
+
+/**
+ * Hold off connecting to a gateway of the pool again for a while
+ *
+ * The wait doubles with each failure in a row, from RECONNECT_MIN_USEC up to
+ * RECONNECT_MAX_USEC, and is drawn from the upper half of that so gateways
+ * (and shards) that lost their sessions together don't all retry together.
+ *
+ * @gw		gateway struct
+ * @m		the pool's gateway that failed
+ */
+static void schedule_reconnect(struct gw_host *gw, struct gw_member *m)
+{
+	uint64_t wait;
+
+	if(m->backoff_usec == 0)
+		m->backoff_usec = RECONNECT_MIN_USEC;
+	else if(m->backoff_usec * 2 < RECONNECT_MAX_USEC)
+		m->backoff_usec *= 2;
+	else
+		m->backoff_usec = RECONNECT_MAX_USEC;
+
+	wait = m->backoff_usec / 2 + rand_r(&gw->seed) % (m->backoff_usec / 2 + 1);
+	m->retry_at = monotonic_usec() + wait;
+	log_msg("Connecting to %s again in %llu ms", m->host,
+			(unsigned long long)(wait / 1000));
+}
+
+static bool session_starting(struct gw_session *s)
+{
+	return s->state == SESS_CONNECTING || s->state == SESS_AUTHENTICATING;
+}
+
+/* Start connecting another session, NULL if that failed straight away */
+static struct gw_session *start_session(struct gw_host *gw, struct gw_member *m,
+										bool compressed)
+{
+	struct gw_session *s = add_gw_session(gw, m, compressed);
+
+	if(s->state == SESS_FAILED)	{
+		if(count_member_sessions(gw, m, compressed) == 0)
+			schedule_reconnect(gw, m);
+		remove_gw_session(gw, s);
+		return NULL;
+	}
+	watch_session(gw, s);
+	return s;
+}
+
+/* Bring the group up on @m, unless it's backing off or already has it */
+static struct gw_session *start_member(struct gw_host *gw, struct gw_member *m,
+									   bool compressed, uint64_t now)
+{
+	struct gw_session *s, *first = NULL;
+	int i;
+
+	if(now < m->retry_at || count_member_sessions(gw, m, compressed) > 0)
+		return NULL;
+
+	log_msg("Connecting %d %s session(s) to %s", gw->min_sessions,
+			compressed ? "compressed" : "plain", m->host);
+	for(i = 0; i < gw->min_sessions; i++)
+		if((s = start_session(gw, m, compressed)) != NULL && first == NULL)
+			first = s;
+	return first;
+}
+
+/* Does @a take the next channel before @b?  Round-trips within an eighth
+ * of each other count as the same, so rtt balancing doesn't flap */
+static bool better_session(struct gw_host *gw, struct gw_session *a,
+						   struct gw_session *b)
+{
+	uint64_t ra, rb;
+
+	if(b == NULL)
+		return true;
+	if(gw->balance == BALANCE_RTT)	{
+		/* Not measured yet counts as slowest */
+		ra = a->srtt_usec ? a->srtt_usec : UINT64_MAX;
+		rb = b->srtt_usec ? b->srtt_usec : UINT64_MAX;
+		if(ra < rb - rb / 8)
+			return true;
+		if(rb < ra - ra / 8)
+			return false;
+	}
+	return a->n_channels < b->n_channels;
+}
+
+/**
+ * Choose the session a new channel goes on
+ *
+ * Only sessions of the group the map wants (compressed or plain) are
+ * considered.  Of the established sessions, on any gateway of the pool, the
+ * one with the fewest channels wins (or the lowest round-trip, with rtt
+ * balancing), skipping any that has refused channels beyond its current
+ * count before.  Failing that a session that is still coming up is
+ * returned, the caller has to wait for it.
+ *
+ * Sessions are only connected when needed: the first request for a group
+ * starts its configured number of sessions on every gateway of the pool
+ * that isn't backing off, and if every session is at its limit and the
+ * config allows more another one is started on the least used gateway.
+ *
+ * @gw			gateway struct
+ * @avoid		session to leave out (the one that just refused), may be NULL
+ * @compressed	which group to pick from
+ * @return		Session to use, NULL if there's no room anywhere
+ */
+static struct gw_session *pick_session(struct gw_host *gw,
+									   struct gw_session *avoid,
+									   bool compressed)
+{
+	struct gw_session *best = NULL, *starting = NULL, *s;
+	struct gw_member *grow = NULL;
+	uint64_t now = monotonic_usec();
+	int i, n, least = 0;
+
+	if(!gw_finishing(gw))
+		for(i = 0; i < gw->n_members; i++)
+			if((s = start_member(gw, gw->members[i], compressed, now)) != NULL)
+				starting = s;
+
+	for(i = 0; i < gw->n_sessions; i++)	{
+		s = gw->sess[i];
+		if(s == avoid || s->compressed != compressed)
+			continue;
+		if(session_starting(s))
+			starting = s;
+		if(s->state != SESS_UP ||
+		   (s->chan_limit > 0 && s->n_channels >= s->chan_limit))
+			continue;
+		if(better_session(gw, s, best))
+			best = s;
+	}
+	if(best != NULL || starting != NULL || gw_finishing(gw))
+		return best != NULL ? best : starting;
+
+	for(i = 0; i < gw->n_members; i++)	{
+		struct gw_member *m = gw->members[i];
+
+		if(now < m->retry_at || !can_add_gw_session(gw, m, compressed))
+			continue;
+		n = count_member_sessions(gw, m, compressed);
+		if(grow == NULL || n < least)	{
+			grow = m;
+			least = n;
+		}
+	}
+	if(grow != NULL)	{
+		log_msg("No %s session to %s has room, opening session %d",
+				compressed ? "compressed" : "plain", grow->host, least + 1);
+		best = start_session(gw, grow, compressed);
+	}
+	return best;
+}
+
+/**
+ * Next read size for a connection, given what the last full-size read got
+ *
+ * Streaming connections fill their reads, so the size doubles up to the
+ * map's max_read and bulk data moves in few big reads.  Interactive ones
+ * come back with a few bytes, so it halves down to READ_SIZE_MIN.
+ *
+ * @cur		Read size that was asked for
+ * @got		Bytes actually read
+ * @max		Largest size allowed for the map
+ * @return	Read size to use next
+ */
+static uint32_t adapt_read_size(uint32_t cur, size_t got, uint32_t max)
+{
+	if(got >= cur && cur < max)
+		return (cur * 2 < max) ? cur * 2 : max;
+	if(got < cur / 4 && cur > READ_SIZE_MIN)
+		return (cur / 2 > READ_SIZE_MIN) ? cur / 2 : READ_SIZE_MIN;
+	return cur;
+}
+
+/**
+ * Write client data to the channel, never more than its remote window
+ *
+ * Anything the window can't take right now is kept in the connection's
+ * input queue and the client socket stops being read until the window grows
+ * again (channel_wontblock_cb) and the queue has been flushed.
+ *
+ * @cs		Connection to write for
+ * @data	Client bytes to append after what's already queued, may be NULL
+ * @len		Number of bytes in @data
+ * @return	0 on success, -1 if the channel failed
+ */
+static int write_to_channel(struct chan_sock *cs, const char *data, size_t len)
+{
+	struct buf_chunk *c;
+	uint32_t win;
+	int rv;
+
+	if(len > 0)
+		append_bufq(&cs->inq, data, len);
+
+	while((c = cs->inq.head) != NULL)	{
+		size_t n = c->len - c->off;
+
+		if((win = ssh_channel_window_size(cs->channel)) == 0)
+			break;
+		if(n > win)
+			n = win;
+
+		rv = ssh_channel_write(cs->channel, c->data + c->off, n);
+		if(rv == SSH_ERROR || ssh_channel_is_eof(cs->channel))	{
+			log_error("Error on ssh_write to channel %p: %s",
+					cs->channel, ssh_get_error(cs->channel));
+			return -1;
+		}
+		if(rv == 0)
+			break;
+		consume_bufq(&cs->inq, rv);
+	}
+
+	cs->rd_blocked = (cs->inq.bytes > 0 ||
+					  ssh_channel_window_size(cs->channel) == 0);
+	update_chan_events(cs);
+	return 0;
+}
+
+/**
+ * Send channel data to the client, queueing whatever the socket won't take
+ *
+ * Data is only sent directly if nothing is queued already, otherwise it goes
+ * to the back of the queue to keep the stream in order.
+ *
+ * @cs		Connection to write to
+ * @data	Bytes read from the channel
+ * @len		Number of bytes
+ * @return	0 on success, -1 if the client socket is broken
+ */
+static int queue_to_client(struct chan_sock *cs, const char *data, size_t len)
+{
+	ssize_t rc = 0;
+
+	if(cs->outq.bytes == 0)	{
+		rc = send(cs->sock_fd, data, len, MSG_NOSIGNAL);
+		if(rc < 0)	{
+			if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				return -1;
+			rc = 0;
+		}
+	}
+
+	if(rc < len)	{
+		append_bufq(&cs->outq, data + rc, len - rc);
+		update_chan_events(cs);
+	}
+	return 0;
+}
+
+/* Stop reading the client and drop it once its queued output is sent */
+static void close_after_flush(struct gw_host *gw, struct chan_sock *cs)
+{
+	if(cs->outq.bytes == 0)	{
+		close_later(gw, cs);
+		return;
+	}
+	cs->chan_eof = true;
+	cs->rd_blocked = true;
+	update_chan_events(cs);
+}
+
+/* Tell a SOCKS client how its connect went, the handshake is over either way */
+static int send_socks_result(struct chan_sock *cs, bool ok)
+{
+	char reply[SOCKS_REPLY_MAX];
+	size_t rlen;
+	int rv;
+
+	socks_result(cs->socks, ok, reply, &rlen);
+	rv = queue_to_client(cs, reply, rlen);
+	free(cs->socks);
+	cs->socks = NULL;
+	return rv;
+}
+
+#define POOL_RETRY_USEC (5 * 1000000)
+
+/* Pool version of channel_open_done(), ready channels go on the map's pool */
+static void pool_open_done(struct gw_host *gw, struct chan_sock *cs,
+						   int rc, uint64_t usec)
+{
+	struct static_port_map *pm = cs->parent;
+
+	pm->pool_pending--;
+	gw->pool_short = true;
+
+	if(rc < 0)	{
+		metric_add(&pm->metrics->c.n_open_failed, 1);
+		pm->pool_retry = monotonic_usec() + POOL_RETRY_USEC;
+		backend_failed(cs);
+		cs->state = CS_FAILED;
+		free_channel(cs);
+		return;
+	}
+
+	metrics_open_latency(pm->metrics, usec);
+	backend_opened(cs);
+	cs->state = CS_OPEN;
+	if(cs->abandoned)
+		free_channel(cs);
+	else
+		append_cs_list(&pm->pool, cs);
+}
+
+/* A probe open to a backend that's out of rotation got its answer */
+static void probe_open_done(struct gw_host *gw, struct chan_sock *cs, int rc)
+{
+	if(rc < 0)
+		backend_failed(cs);
+	else
+		backend_opened(cs);
+	cs->state = (rc < 0) ? CS_FAILED : CS_OPEN;
+	free_channel(cs);
+}
+
+static void start_channel_open(struct gw_host *gw, struct chan_sock *cs);
+
+/**
+ * Retry a refused open on another session
+ *
+ * libssh doesn't tell us why an open failed, so when the session already
+ * carries other channels we assume it may have hit a server-side limit and
+ * try once more elsewhere.  Only if that succeeds is the limit remembered.
+ *
+ * @gw		gateway struct
+ * @cs		connection whose open just failed
+ * @return	0 if the open was restarted on another session, -1 otherwise
+ */
+static int spill_channel(struct gw_host *gw, struct chan_sock *cs)
+{
+	struct gw_session *s;
+
+	if(cs->spill_from != NULL || cs->sess->n_channels <= 1 ||
+	   (s = pick_session(gw, cs->sess, cs->sess->compressed)) == NULL ||
+	   s->state != SESS_UP)
+		return -1;
+
+	debug("Channel open refused on a session to %s, retrying on another",
+		  gw->name);
+	cs->spill_from = cs->sess;
+	if(move_channel_to_session(cs, s) < 0)
+		log_exit(CONNECTION_RETRY, "Error creating new channel for connection");
+	start_channel_open(gw, cs);
+	return 0;
+}
+
+/**
+ * Send a connection whose backend couldn't be reached to another one
+ *
+ * Every other backend of the map that is up gets one try before the client
+ * is given up on.
+ *
+ * @gw		gateway struct
+ * @cs		connection whose open just failed, its backend marked down
+ * @return	0 if the open was restarted to another backend, -1 otherwise
+ */
+static int retry_backend(struct gw_host *gw, struct chan_sock *cs)
+{
+	struct static_port_map *pm = cs->parent;
+	struct gw_session *s;
+
+	if(cs->be == NULL || ++cs->be_tries >= pm->n_be ||
+	   !other_backend_up(pm, cs->be) ||
+	   (s = pick_session(gw, NULL, pm->compress)) == NULL ||
+	   s->state != SESS_UP)
+		return -1;
+
+	debug("Open to %s:%d failed, trying another backend for port %d",
+		  cs->be->host, cs->be->port, pm->local_port);
+	drop_backend(cs);
+	cs->spill_from = NULL;
+	if(move_channel_to_session(cs, s) < 0)
+		log_exit(CONNECTION_RETRY, "Error creating new channel for connection");
+	start_channel_open(gw, cs);
+	return 0;
+}
+
+/* The connection's channel can't be had, tell a SOCKS client and drop it */
+static void fail_connection(struct gw_host *gw, struct chan_sock *cs)
+{
+	metric_add(&cs->parent->metrics->c.n_failed, 1);
+	cs->state = CS_FAILED;
+	if(cs->abandoned)
+		free_channel(cs);
+	else if(cs->socks != NULL && send_socks_result(cs, false) == 0)
+		close_after_flush(gw, cs);
+	else
+		close_later(gw, cs);
+}
+
+/**
+ * The gateway answered (or failed to answer) an open for @cs
+ *
+ * On success the client bytes buffered while we waited are written to the
+ * channel, and the open latency is recorded against the map.
+ *
+ * @gw		gateway struct
+ * @cs		connection whose channel open completed
+ * @rc		1 if the channel is open, -1 if it failed
+ */
+static void channel_open_done(struct gw_host *gw, struct chan_sock *cs, int rc)
+{
+	struct static_port_map *pm = cs->parent;
+	uint64_t usec = monotonic_usec() - cs->open_start;
+
+	remove_cs_list(&gw->opening, cs);
+
+	if(cs->pooled)	{
+		pool_open_done(gw, cs, rc, usec);
+		return;
+	}
+	if(cs->probe)	{
+		probe_open_done(gw, cs, rc);
+		return;
+	}
+
+	if(rc < 0 && !cs->abandoned && spill_channel(gw, cs) == 0)
+		return;
+
+	if(rc < 0)	{
+		metric_add(&pm->metrics->c.n_open_failed, 1);
+		if(cs->be != NULL)
+			backend_failed(cs);
+		if(!cs->abandoned && retry_backend(gw, cs) == 0)
+			return;
+		fail_connection(gw, cs);
+		return;
+	}
+
+	/* The other session took it, so the first one was at its limit */
+	if(cs->spill_from != NULL)	{
+		if(cs->spill_from->chan_limit == 0 ||
+		   cs->spill_from->n_channels < cs->spill_from->chan_limit)	{
+			cs->spill_from->chan_limit = cs->spill_from->n_channels;
+			log_msg("Session to %s refuses channels past %d",
+					cs->spill_from->member->host, cs->spill_from->chan_limit);
+		}
+		cs->spill_from = NULL;
+	}
+
+	metrics_open_latency(pm->metrics, usec);
+	if(cs->be != NULL)
+		backend_opened(cs);
+	debug("Channel %p open %d -> %s:%d took %llu us", cs->channel,
+		  pm->local_port, cs->dest_host ? cs->dest_host : cs->be->host,
+		  cs->dest_host ? cs->dest_port : cs->be->port,
+		  (unsigned long long)usec);
+
+	cs->state = CS_OPEN;
+	if(cs->abandoned)	{
+		free_channel(cs);
+		return;
+	}
+
+	if(cs->socks != NULL && send_socks_result(cs, true) < 0)
+		close_later(gw, cs);
+	else if(write_to_channel(cs, NULL, 0) < 0)
+		close_later(gw, cs);
+	else
+		mark_channel_ready(cs);
+}
+
+static void start_channel_open(struct gw_host *gw, struct chan_sock *cs)
+{
+	int rc;
+
+	cs->state = CS_OPENING;
+	cs->open_start = monotonic_usec();
+	append_cs_list(&gw->opening, cs);
+
+	if((rc = connect_forward_channel(cs)) != 0)
+		channel_open_done(gw, cs, rc);
+}
+
+/**
+ * Start the opens of queued connections while the pipeline has room
+ *
+ * A queued connection has no channel yet, it gets one on the session picked
+ * for it now.  Connections whose session is still being set up (or waiting
+ * to be reconnected) stay queued, for up to the gateway's hold_timeout.
+ *
+ * @gw		gateway struct
+ */
+static void start_queued_opens(struct gw_host *gw)
+{
+	struct chan_sock *cs, *next;
+	struct gw_session *s;
+	uint64_t now = monotonic_usec();
+
+	for(cs = gw->open_queue.head; cs != NULL; cs = next)	{
+		next = cs->open_next;
+		if(gw->opening.n >= gw->max_opening)
+			break;
+
+		if((s = pick_session(gw, NULL, cs->parent->compress)) == NULL ||
+		   s->state != SESS_UP)	{
+			if(now - cs->queued_at < gw->hold_usec && !gw_finishing(gw))
+				continue;
+			log_error("No session to %s in time, dropping fd=%d", gw->name,
+					cs->sock_fd);
+			metric_add(&cs->parent->metrics->c.n_hold_expired, 1);
+			remove_cs_list(&gw->open_queue, cs);
+			fail_connection(gw, cs);
+			continue;
+		}
+
+		remove_cs_list(&gw->open_queue, cs);
+		if(move_channel_to_session(cs, s) < 0)
+			log_exit(CONNECTION_RETRY, "Error creating new channel for connection");
+		start_channel_open(gw, cs);
+	}
+}
+
+/* Open now if there's room in the pipeline and a session, otherwise wait */
+static void queue_channel_open(struct gw_host *gw, struct chan_sock *cs)
+{
+	cs->state = CS_QUEUED;
+	cs->queued_at = monotonic_usec();
+	append_cs_list(&gw->open_queue, cs);
+	start_queued_opens(gw);
+}
+
+/* Is there a session up that the map's connections could use right now? */
+static bool map_has_session(struct gw_host *gw, struct static_port_map *pm)
+{
+	int i;
+
+	for(i = 0; i < gw->n_sessions; i++)
+		if(gw->sess[i]->state == SESS_UP &&
+		   gw->sess[i]->compressed == pm->compress)
+			return true;
+	return false;
+}
+
+/**
+ * Move the in-flight channel opens along and start queued ones
+ *
+ * Answers from the gateway are only read off the session socket, so unless
+ * it was active (or we timed out) just check for channels libssh already
+ * saw confirmed while doing other work, which costs no syscall.
+ *
+ * @gw			gateway struct
+ * @session_io	true if the session socket had activity this pass
+ */
+static void process_channel_opens(struct gw_host *gw, bool session_io)
+{
+	struct chan_sock *cs, *next;
+	int rc;
+
+	for(cs = gw->opening.head; cs != NULL; cs = next)	{
+		next = cs->open_next;
+		if(!session_io && !ssh_channel_is_open(cs->channel))
+			continue;
+		if((rc = connect_forward_channel(cs)) != 0)
+			channel_open_done(gw, cs, rc);
+	}
+
+	if(gw->open_queue.n > 0)
+		start_queued_opens(gw);
+}
+
+/**
+ * Top up the warm pool of pre-opened channels for @pm
+ *
+ * Pool opens only use spare room in the open pipeline, clients are never
+ * queued behind them.  After a failed pool open we back off for a while so
+ * a dead backend doesn't keep the gateway busy.
+ *
+ * @gw		gateway struct
+ * @pm		map whose pool to fill
+ */
+static void fill_pool(struct gw_host *gw, struct static_port_map *pm)
 {
-	for(int i = 0; i < gw->n_maps; i++)	{
-		for(int j = 0; j < gw->pm[i]->n_channels; j++)	{
-			if(ch == gw->pm[i]->ch[j]->channel)
-				return gw->pm[i]->ch[j];
+	struct gw_session *sess;
+	struct chan_sock *cs;
+
+	while(pm->pool.n + pm->pool_pending < pm->opts.pool_size &&
+		  gw->opening.n < gw->max_opening &&
+		  pm->pool_retry <= monotonic_usec())	{
+
+		/* Wait for the session if it's still coming up */
+		if((sess = pick_session(gw, NULL, pm->compress)) != NULL &&
+		   sess->state != SESS_UP)
+			break;
+		if(sess == NULL || (cs = new_chan_sock(pm, sess)) == NULL)	{
+			log_error("Error creating pool channel for %d", pm->local_port);
+			return;
 		}
+		cs->pooled = true;
+		pm->pool_pending++;
+		start_channel_open(gw, cs);
 	}
-	return NULL;
+
+	if(pm->pool.n + pm->pool_pending < pm->opts.pool_size)
+		gw->pool_short = true;
+}
+
+static void fill_pools(struct gw_host *gw)
+{
+	int i;
+
+	/* Pools only fill once clients have brought the sessions up */
+	if(!gw->pool_short || gw_finishing(gw) || gw->n_sessions == 0)
+		return;
+
+	gw->pool_short = false;
+	for(i = 0; i < gw->n_maps; i++)
+		if(gw->pm[i]->opts.pool_size > 0 && !gw->pm[i]->draining)
+			fill_pool(gw, gw->pm[i]);
 }
 
 /**
- * Create a new ssh_channel for a new incomming connection on @listenfd
+ * Try the backends that are out of rotation again
+ *
+ * Each down backend gets a probe open of its own every BACKEND_PROBE_USEC,
+ * using spare room in the open pipeline of a session that's up.  The probe
+ * channel is closed as soon as the answer is in, see probe_open_done().
+ *
+ * @gw		gateway with backends down
+ */
+static void probe_backends(struct gw_host *gw)
+{
+	uint64_t now = monotonic_usec();
+	struct gw_session *s;
+	struct chan_sock *cs;
+	int i, j;
+
+	for(i = 0; i < gw->n_maps; i++)	{
+		struct static_port_map *pm = gw->pm[i];
+
+		if(pm->n_down == 0 || pm->draining || !map_has_session(gw, pm))
+			continue;
+		for(j = 0; j < pm->n_be; j++)	{
+			struct backend *be = pm->be[j];
+
+			if(!be->down || be->probing || be->probe_at > now)
+				continue;
+			if(gw->opening.n >= gw->max_opening ||
+			   (s = pick_session(gw, NULL, pm->compress)) == NULL ||
+			   s->state != SESS_UP)
+				return;
+			if((cs = new_chan_sock(pm, s)) == NULL)	{
+				log_error("Error creating probe channel for %d", pm->local_port);
+				return;
+			}
+			debug("Probing backend %s:%d of map %d", be->host, be->port,
+				  pm->local_port);
+			cs->probe = true;
+			use_backend(cs, be);
+			start_channel_open(gw, cs);
+		}
+	}
+}
+
+/* Leave new clients in the listen backlog until there's room for them */
+static void pause_listener(struct gw_host *gw, struct static_port_map *pm,
+						   uint64_t resume_at)
+{
+	pm->resume_at = resume_at;
+	if(pm->paused)
+		return;
+
+	debug("Pausing accepts on port %d", pm->local_port);
+	event_mod(gw->ev, pm->listen_fd, 0);
+	pm->paused = true;
+	metric_add(&pm->metrics->c.n_paused, 1);
+	gw->n_paused++;
+}
+
+static bool map_at_cap(struct gw_host *gw, struct static_port_map *pm)
+{
+	return (pm->opts.max_conns > 0 && pm->n_channels >= pm->opts.max_conns) ||
+		   (gw->max_conns > 0 && gw->n_conns >= gw->max_conns);
+}
+
+/* Start accepting again on listeners whose cap or fd back-off has passed,
+ * and try again to listen on ports that were taken after a reload */
+static void resume_listeners(struct gw_host *gw)
+{
+	uint64_t now;
+	int i;
+
+	if(gw->n_paused == 0 || gw_finishing(gw))
+		return;
+
+	now = monotonic_usec();
+	for(i = 0; i < gw->n_maps; i++)	{
+		struct static_port_map *pm = gw->pm[i];
+
+		if(!pm->paused || pm->resume_at > now || map_at_cap(gw, pm))
+			continue;
+		if(pm->listen_fd < 0 && !open_map_listener(pm))	{
+			pm->resume_at = now + LISTEN_RETRY_USEC;
+			continue;
+		}
+
+		debug("Resuming accepts on port %d", pm->local_port);
+		event_mod(gw->ev, pm->listen_fd, EPOLLIN);
+		pm->paused = false;
+		gw->n_paused--;
+	}
+}
+
+/**
+ * Accept a new incomming connection on @pm's listener and start its channel open
+ *
+ * If the map has a warm channel in its pool the client is bound to it right
+ * away.  Otherwise the open request goes out without waiting for the answer;
+ * if too many opens are already in flight, or the session to the gateway is
+ * still being connected (the first client does that), the connection waits
+ * its turn in the queue.  On a SOCKS map the open waits for the client's
+ * handshake.
+ *
+ * At the map's or gateway's connection cap the listener is paused instead,
+ * the kernel keeps further clients in the backlog until we catch up.  Out
+ * of descriptors, clients are turned away or the listener backs off.
  *
  * @gw	gateway struct
- * @listenfd	The listening file-descriptor with a pending connection
+ * @pm	map whose listener has pending connections
+ * @return	The new client fd, -1 if no more should be accepted right now
 */
-static int new_connection(struct gw_host *gw,
-						  int listenfd)
+static int new_connection(struct gw_host *gw, struct static_port_map *pm)
 {
-	struct static_port_map *pm;
 	struct chan_sock *cs;
-	ssh_channel channel;
+	uint64_t accepted_at;
 	int new_fd;
 
-	new_fd = accept_connection(listenfd);
+	if(map_at_cap(gw, pm))	{
+		pause_listener(gw, pm, 0);
+		return -1;
+	}
 
-	debug("is listen fd, new conn accepted(%d): fd=%d", listenfd, new_fd);
+	switch(new_fd = accept_connection(pm->listen_fd, &pm->opts.sock))	{
+		case ACCEPT_NONE:
+			return -1;
+		case ACCEPT_SHED:
+			metric_add(&pm->metrics->c.n_shed, 1);
+			return 0;
+		case ACCEPT_FULL:
+			metric_add(&pm->metrics->c.n_fd_full, 1);
+			pause_listener(gw, pm, monotonic_usec() + ACCEPT_PAUSE_USEC);
+			return -1;
+		default:
+			break;
+	}
 
-	if((channel = ssh_channel_new(gw->session)) == NULL)
-		log_exit(CONNECTION_RETRY, "Error creating new channel for connection");
+	debug("is listen fd, new conn accepted(%d): fd=%d", pm->listen_fd, new_fd);
 
-	if((pm = get_map_for_listening(gw, listenfd)) == NULL)
-		log_exit(FATAL_ERROR, "Error: fd %d map not found", listenfd);
+	metric_add(&pm->metrics->c.n_accepted, 1);
+	accepted_at = monotonic_usec();
 
-	cs = add_channel_to_map(pm, channel, new_fd);
+	/* Anything the backend sent before we got here is read right away */
+	if((cs = pm->pool.head) != NULL)	{
+		debug("Using pooled channel %p for fd=%d", cs->channel, new_fd);
+		remove_cs_list(&pm->pool, cs);
+		cs->pooled = false;
+		cs->accepted_at = accepted_at;
+		attach_client(cs, new_fd);
+		mark_channel_ready(cs);
+		metric_add(&pm->metrics->c.n_pool_hits, 1);
+		gw->pool_short = true;
+		return new_fd;
+	}
 
-	if(connect_forward_channel(cs) < 0)	{
-		log_msg("Removing listening port %d because bad connection", pm->local_port);
-		remove_map_from_gw(pm);
-		return -1;
+	/* Only so many clients are held while the gateway can't be reached */
+	if(gw->open_queue.n >= gw->hold_max && !map_has_session(gw, pm))	{
+		log_error("No session to %s, turning away fd=%d", gw->name, new_fd);
+		metric_add(&pm->metrics->c.n_hold_full, 1);
+		metric_add(&pm->metrics->c.n_failed, 1);
+		close(new_fd);
+		return new_fd;
+	}
+
+	/* The session (and channel) is picked when the open is started */
+	if((cs = add_channel_to_map(pm, NULL, new_fd)) == NULL)
+		log_exit(CONNECTION_RETRY, "Error creating new channel for connection");
+	cs->accepted_at = accepted_at;
+	if(pm->opts.balance == BACKEND_SOURCE && pm->n_be > 1)
+		cs->src_hash = peer_addr_hash(new_fd);
+
+	if(pm->dynamic)	{
+		cs->socks = safemalloc(sizeof(struct socks_state), "socks state");
+		cs->state = CS_SOCKS;
+	} else {
+		queue_channel_open(gw, cs);
 	}
+
 	return new_fd;
 }
 
-static int update_channels(struct gw_host *gw,
-						   ssh_channel **chs,
-						   ssh_channel **outchs,
-						   int *nchan)
+/**
+ * Read more of a SOCKS client's handshake and act on it
+ *
+ * Only the handshake buffer's free space is read, so nothing of the
+ * client's stream is taken before we know where it goes.  Once the request
+ * is complete any bytes behind it become early data for the channel.
+ *
+ * @gw		gateway struct
+ * @cs		connection still in the SOCKS handshake
+ */
+static void socks_client_input(struct gw_host *gw, struct chan_sock *cs)
 {
-	int i, j, k;
-	int new_n = 0;
+	struct socks_state *ss = cs->socks;
+	char reply[SOCKS_REPLY_MAX];
+	size_t rlen;
+	int n_read;
 
-	for(i = 0; i < gw->n_maps; i++)
-		new_n += gw->pm[i]->n_channels;
+	n_read = recv(cs->sock_fd, ss->buf + ss->len, sizeof(ss->buf) - ss->len, 0);
+	if(n_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return;
+	if(n_read <= 0)	{
+		close_later(gw, cs);
+		return;
+	}
+	ss->len += n_read;
 
-	if(new_n != *nchan || (*chs == NULL))	{
-		saferealloc((void **)chs, (new_n + 1) * sizeof(ssh_channel), "channels");
-		saferealloc((void **)outchs, (new_n + 1) * sizeof(ssh_channel), "outchannels");
+	switch(socks_input(ss, reply, &rlen))	{
+		case SOCKS_MORE:
+			if(rlen > 0 && queue_to_client(cs, reply, rlen) < 0)
+				close_later(gw, cs);
+			break;
+		case SOCKS_FAIL:
+			debug("SOCKS handshake failed on fd=%d", cs->sock_fd);
+			if(rlen > 0 && queue_to_client(cs, reply, rlen) == 0)
+				close_after_flush(gw, cs);
+			else
+				close_later(gw, cs);
+			break;
+		case SOCKS_DONE:
+			if(rlen > 0 && queue_to_client(cs, reply, rlen) < 0)	{
+				close_later(gw, cs);
+				break;
+			}
+			debug("SOCKS fd=%d connect to %s:%d", cs->sock_fd, ss->host, ss->port);
+			cs->dest_host = safestrdup(ss->host, "socks dest host");
+			cs->dest_port = ss->port;
+			if(ss->len > ss->used)
+				append_bufq(&cs->inq, ss->buf + ss->used, ss->len - ss->used);
+			queue_channel_open(gw, cs);
+			break;
 	}
+}
 
-	for(i = 0, k = 0; i < gw->n_maps; i++)
-		for(j = 0; j < gw->pm[i]->n_channels; j++)
-			(*chs)[k++] = gw->pm[i]->ch[j]->channel;
+/**
+ * Keep a small client read back so it goes to the channel with the next ones
+ *
+ * Only on maps with coalesce_usec set.  Once the held data reaches the map's
+ * coalesce_bytes it is written out along with this read.
+ *
+ * @gw		gateway struct
+ * @cs		connection the data was read from
+ * @data	client bytes
+ * @len		number of bytes
+ * @return	true if the data was held, false if the caller should write it
+ */
+static bool coalesce_input(struct gw_host *gw, struct chan_sock *cs,
+						   const char *data, size_t len)
+{
+	struct static_port_map *pm = cs->parent;
 
-	(*chs)[new_n] = NULL;
-	*nchan = new_n;
+	if(pm->opts.coalesce_usec == 0 || cs->rd_blocked ||
+	   cs->inq.bytes + len >= pm->opts.coalesce_bytes)	{
+		if(cs->coalescing)	{
+			stop_coalescing(cs);
+			metric_add(&pm->metrics->c.n_co_flushes, 1);
+		}
+		return false;
+	}
 
-	return 1;
+	append_bufq(&cs->inq, data, len);
+	cs->rx_pass = gw->pass;
+	metric_add(&pm->metrics->c.n_coalesced, 1);
+	start_coalescing(cs, monotonic_usec() + pm->opts.coalesce_usec);
+	return true;
 }
 
-#define CHAN_BUF_SIZE 4096 * 4
+/**
+ * Write out coalesced client data that shouldn't wait any longer
+ *
+ * Data goes out when its time budget is up, or as soon as a pass goes by
+ * in which the client sent nothing more, an idle client gains nothing from
+ * waiting.
+ *
+ * @gw		gateway struct
+ */
+static void process_coalesced(struct gw_host *gw)
+{
+	struct chan_sock *cs, *next;
+	uint64_t now = monotonic_usec();
 
-int select_loop(struct gw_host *gw)
+	for(cs = gw->coalescing; cs != NULL; cs = next)	{
+		next = cs->co_next;
+		if(cs->rx_pass == gw->pass && cs->flush_at > now && !cs->closing)
+			continue;
+
+		stop_coalescing(cs);
+		metric_add(&cs->parent->metrics->c.n_co_flushes, 1);
+		if(!cs->closing && write_to_channel(cs, NULL, 0) < 0)
+			close_later(gw, cs);
+	}
+}
+
+/**
+ * Handle readiness on a client socket
+ *
+ * Flushes queued output if the socket is writable, then reads what the
+ * channel can take: up to its remote window once open, or up to
+ * CHAN_EARLY_MAX held in the input queue while the open is in flight.
+ * Each read is the connection's current read size, see adapt_read_size().
+ *
+ * @gw		gateway struct
+ * @cs		the client's connection
+ * @events	epoll events reported for the socket
+ * @buf		scratch buffer
+ * @len		size of @buf
+ */
+static void client_event(struct gw_host *gw, struct chan_sock *cs,
+						 uint32_t events, char *buf, size_t len)
 {
+	int fd = cs->sock_fd;
+	size_t max_read, total;
+	int n_read;
+	bool sized;
 
-	fd_set master, read_fds, listen_set;
-	ssh_channel *channels = NULL, *outchannels = NULL;
-	socket_t maxfd = 0;
-	char buf[CHAN_BUF_SIZE];
-	int i, j, n_chans = 0;
-	bool exit_loop = false;
+	/* Client can take more of its queued output */
+	if(events & EPOLLOUT)	{
+		if(flush_bufq(&cs->outq, fd) < 0)	{
+			log_error("Write error on socket %d: %s", fd, strerror(errno));
+			close_later(gw, cs);
+			return;
+		}
+		if(cs->outq.bytes == 0)	{
+			if(cs->chan_eof)	{
+				close_later(gw, cs);
+				return;
+			}
+			update_chan_events(cs);
+		}
+		/* Start reading the channel again once we're under the mark */
+		if(cs->throttled && cs->outq.bytes <= CHAN_OUTQ_LOWAT)	{
+			cs->throttled = false;
+			mark_channel_ready(cs);
+		}
+	}
 
-	FD_ZERO(&master);
-	FD_ZERO(&listen_set);
-	for(i = 0; i < gw->n_maps; i++)	{
-		FD_SET(gw->pm[i]->listen_fd, &master);
-		if(gw->pm[i]->listen_fd > maxfd)
-			maxfd = gw->pm[i]->listen_fd;
-		for(j = 0; j < gw->pm[i]->n_channels; j++)	{
-			if(gw->pm[i]->ch[j]->sock_fd > maxfd)
-				maxfd = gw->pm[i]->ch[j]->sock_fd;
-			FD_SET(gw->pm[i]->ch[j]->sock_fd, &master);
+	/* Not reading, but a hangup or error still ends the connection */
+	if(cs->rd_blocked && (events & (EPOLLERR | EPOLLHUP)))	{
+		close_later(gw, cs);
+		return;
+	}
+
+	if(cs->rd_blocked || !(events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+		return;
+
+	if(cs->state == CS_SOCKS)	{
+		socks_client_input(gw, cs);
+		return;
+	}
+
+	/* Read until the socket is empty, the channel can't take more or the
+	 * connection has had its share of this pass */
+	for(total = 0; total < DRAIN_BUDGET; total += n_read)	{
+		/* Never read more than the channel can take */
+		if(cs->state == CS_OPEN)
+			max_read = ssh_channel_window_size(cs->channel);
+		else
+			max_read = CHAN_EARLY_MAX - cs->inq.bytes;
+
+		if(max_read == 0)	{
+			cs->rd_blocked = true;
+			update_chan_events(cs);
+			return;
+		}
+		sized = (max_read >= cs->rd_size);
+		if(sized)
+			max_read = cs->rd_size;
+		if(max_read > len)
+			max_read = len;
+
+		n_read = recv(fd, buf, max_read, 0);
+
+		debug("Write %d bytes to channel %p (read from user socket fd=%d)",
+			  n_read, cs->channel, fd);
+
+		if(n_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+
+		if(n_read <= 0)	{
+		/* Tear down the channel on zero-read or error if user disconnected */
+			if(n_read < 0)
+				log_error("Read error on fd=%d channel %p: %s",
+						fd, cs->channel, strerror(errno));
+
+			close_later(gw, cs);
+			event_del(gw->ev, fd);
+			return;
+		}
+
+		if(sized)
+			cs->rd_size = adapt_read_size(cs->rd_size, n_read,
+										  cs->parent->opts.max_read);
+		sample_map_traffic(cs->parent, buf, n_read);
+		metric_add(&cs->parent->metrics->c.bytes_in, n_read);
+
+		if(cs->state != CS_OPEN)	{
+		/* Hold on to early data until the gateway confirms the channel */
+			append_bufq(&cs->inq, buf, n_read);
+			if(cs->inq.bytes >= CHAN_EARLY_MAX)	{
+				cs->rd_blocked = true;
+				update_chan_events(cs);
+			}
+			return;
+		} else if(coalesce_input(gw, cs, buf, n_read))	{
+		/* Small read held back to go out with the next ones */
+		} else if(write_to_channel(cs, buf, n_read) < 0)	{
+		/* Otherwise pass user data to ssh_channel, drop it if that fails */
+			close_later(gw, cs);
+			return;
 		}
-		FD_SET(gw->pm[i]->listen_fd, &listen_set);
+
+		/* A short read means the socket is empty for now */
+		if(n_read < max_read || cs->rd_blocked)
+			return;
 	}
+}
 
-	/* This is the program's main loop right here */
-	while(!exit_loop && !hard_shutdown)	{
-		struct timeval tm;
-		int n_read;
-		int n_chan_rm;
-		struct chan_sock **channels_to_remove;
-		struct chan_sock *cs;
-
-		tm.tv_sec = (finish_main_loop) ? 0 : 5;
-		tm.tv_usec = (finish_main_loop) ? 250000 : 0;
-		read_fds = master;
-		update_channels(gw, &channels, &outchannels, &n_chans);
-		if(n_chans == 0)	{
-			if(finish_main_loop)
-				exit_loop = true;
+/**
+ * Read any output from ssh and pass it to the client sockets
+ *
+ * Only channels that the callbacks flagged are visited.  The list is taken
+ * whole, anything flagged while we work on it (or that still has data after
+ * its DRAIN_BUDGET of reads) is picked up on the next pass.
+ *
+ * @gw		gateway struct
+ * @buf		scratch buffer
+ * @len		size of @buf
+ */
+static void process_ready_channels(struct gw_host *gw, char *buf, size_t len)
+{
+	struct chan_sock *cs, *batch;
+	size_t total, want;
+	int n_read;
+
+	batch = gw->ready;
+	gw->ready = NULL;
+	while((cs = batch) != NULL)	{
+		ssh_channel ch = cs->channel;
+
+		batch = cs->ready_next;
+		cs->ready = false;
+
+		/* Idle pool channel, only care if the backend hung up on it */
+		if(cs->pooled)	{
+			if(ssh_channel_is_eof(ch) || ssh_channel_is_closed(ch))	{
+				debug("Pooled channel %p closed by remote", ch);
+				remove_pooled_channel(cs);
+				gw->pool_short = true;
+			}
+			continue;
 		}
-		switch(ssh_select(channels, outchannels, maxfd + 1, &read_fds, &tm))
-		{
-			case SSH_EINTR:
-				debug("select() gave EINTR");
-				continue;
-			case SSH_OK:
-				break;
-			default:
-				log_msg("ssh_select error reported!");
-				finish_main_loop = 1;
+
+		if(cs->closing || cs->chan_eof || cs->state != CS_OPEN)
+			continue;
+
+		/* Window grew, push out what the client sent meanwhile */
+		if(cs->rd_blocked && write_to_channel(cs, NULL, 0) < 0)	{
+			close_later(gw, cs);
+			continue;
 		}
 
-		n_chan_rm = 0;
-		channels_to_remove = NULL;
-		/* Loop over our custom select'd fd's to see if there are any new
-		 * connections or reads waiting to happen and perform them
+		/* Leave data in the channel until the client catches up, libssh
+		 * won't grow the window while it holds unread data so the
+		 * remote end stops sending too.
 		 */
-		for(i = 0; i <= maxfd; i++)	{
+		for(total = 0; total < DRAIN_BUDGET; total += n_read)	{
+			if(cs->outq.bytes >= CHAN_OUTQ_HIWAT)	{
+				cs->throttled = true;
+				break;
+			}
 
-			if(!FD_ISSET(i, &read_fds))
-				continue;
+			want = (cs->chan_rd_size < len) ? cs->chan_rd_size : len;
+			n_read = ssh_channel_read_nonblocking(ch, buf, want, 0);
+
+			if(n_read > 0)	{
+				debug("Read %d bytes from channel %p, write to %d",
+					  n_read, ch, cs->sock_fd);
 
-			/* On connect, create+add new channel to map */
-			if(FD_ISSET(i, &listen_set))	{
-
-				if(finish_main_loop)	{
-					FD_CLR(i, &listen_set);
-					FD_CLR(i, &master);
-					close(i);
-				} else {
-					int new_fd;
-					new_fd = new_connection(gw, i);
-					if(new_fd >= 0)	{
-						FD_SET(new_fd, &master);
-						if(new_fd > maxfd)
-							maxfd = new_fd;
-					} else {
-						FD_CLR(i, &listen_set);
-						FD_CLR(i, &master);
-					}
+				cs->chan_rd_size = adapt_read_size(cs->chan_rd_size, n_read,
+												   cs->parent->opts.max_read);
+				sample_map_traffic(cs->parent, buf, n_read);
+				metric_add(&cs->parent->metrics->c.bytes_out, n_read);
+				if(!cs->replied && cs->accepted_at > 0)	{
+					cs->replied = true;
+					metrics_ttfb(cs->parent->metrics,
+								 monotonic_usec() - cs->accepted_at);
 				}
-				continue;
+				if(queue_to_client(cs, buf, n_read) < 0)	{
+					log_error("Write error on socket %d: %s",
+							cs->sock_fd, strerror(errno));
+					close_later(gw, cs);
+					break;
+				}
+				/* Short read, libssh has nothing more buffered */
+				if(n_read < want)
+					break;
+			} else if (n_read == SSH_EOF ||
+					   (n_read == 0 && ssh_channel_is_eof(ch)))	{
+				/* close socket, once the client has everything we owe it */
+
+				log_error("Zero bytes read from channel %p, removing", ch);
+				if(cs->outq.bytes > 0)
+					cs->chan_eof = true;
+				else
+					close_later(gw, cs);
+				break;
+			} else if (n_read < 0)	{
+				/* error case */
+				log_error("Error with ssh_channel_read on channel %p", ch);
+				close_later(gw, cs);
+				break;
+			} else {
+				break;
 			}
+		}
 
-			/* Otherwise read data from socket and write to channel */
-			if((cs = get_chan_for_fd(gw, i)) == NULL)
-				log_exit(FATAL_ERROR, "Error: fd %d channel not found", i);
+		/* Had our share for this pass, the rest waits for the next one */
+		if(total >= DRAIN_BUDGET)
+			mark_channel_ready(cs);
+	}
+}
 
-			n_read = recv(cs->sock_fd, buf, sizeof(buf), 0);
+/* Wait for session sockets to be writable only while libssh has output,
+ * and publish how many sessions are up */
+static void update_session_events(struct gw_host *gw)
+{
+	int i, n_up = 0;
 
-			debug("Write %d bytes to channel %p (read from user socket fd=%d)",
-				  n_read, cs->channel, i);
+	for(i = 0; i < gw->n_sessions; i++)	{
+		struct gw_session *s = gw->sess[i];
+		uint32_t want = EPOLLIN;
 
-			if(n_read <= 0)	{
-			/* Tear down the channel on zero-read or error if user disconnected */
-				if(n_read < 0)
-					log_msg("Read error on fd=%d channel %p: %s",
-							i, cs->channel, strerror(errno));
+		if(s->state == SESS_FAILED)
+			continue;
+		if(s->state == SESS_UP)
+			n_up++;
 
-				saferealloc((void **)&channels_to_remove,
-							(n_chan_rm + 1) * sizeof(struct chan_sock *),
-							"removed channels");
+		if(ssh_get_poll_flags(s->session) & SSH_WRITE_PENDING)
+			want |= EPOLLOUT;
 
-				channels_to_remove[n_chan_rm] = cs;
-				n_chan_rm += 1;
+		if(want != s->events)	{
+			event_mod(gw->ev, s->fd, want);
+			s->events = want;
+		}
+	}
+	metric_set(&gw->metrics->n_sessions, n_up);
+}
 
-				FD_CLR(i, &master);
-			} else {
-			/* Otherwise pass user data to ssh_channel */
-				int n_written = 0;
-				while(n_written < n_read)	{
-					int rv;
-					rv = ssh_channel_write(cs->channel, buf + n_written,
-												n_read - n_written);
-					if(rv == SSH_ERROR || ssh_channel_is_eof(cs->channel))	{
-						log_msg("Error on ssh_write to channel %p: %s",
-								cs->channel, ssh_get_error(cs->channel));
-
-						/* Should we shut down this way? */
-						if(shutdown(cs->sock_fd, SHUT_WR) != 0)
-							log_msg("Shutdown socket %d: %s", i, strerror(errno));
-						break;
-					}
-					n_written += rv;
-				}
+/* A session that couldn't be set up, clients waiting on its group stay
+ * held while we retry, until their hold_timeout */
+static void session_failed(struct gw_host *gw, struct gw_session *s)
+{
+	if(count_member_sessions(gw, s->member, s->compressed) == 1)
+		schedule_reconnect(gw, s->member);
+	unwatch_session(gw, s);
+	remove_gw_session(gw, s);
+}
+
+/**
+ * Drop what a dead session carried
+ *
+ * Clients with an open channel can't be carried over, their stream is cut.
+ * Connections still waiting for their open go back on the queue to be
+ * opened on the next session, pooled channels are just dropped.
+ *
+ * @gw		gateway struct
+ * @s		the session that died
+ */
+static void drop_session_channels(struct gw_host *gw, struct gw_session *s)
+{
+	struct chan_sock *cs, *next;
+	int i;
+
+	for(cs = gw->opening.head; cs != NULL; cs = next)	{
+		next = cs->open_next;
+		if(cs->spill_from == s)
+			cs->spill_from = NULL;
+		if(cs->sess != s)
+			continue;
+		remove_cs_list(&gw->opening, cs);
+		if(cs->pooled)
+			cs->parent->pool_pending--;
+		if(cs->pooled || cs->probe || cs->abandoned)	{
+			free_channel(cs);
+			continue;
+		}
+		release_channel(cs);
+		cs->spill_from = NULL;
+		cs->state = CS_QUEUED;
+		cs->queued_at = monotonic_usec();
+		append_cs_list(&gw->open_queue, cs);
+	}
+
+	for(i = 0; i < gw->n_maps; i++)	{
+		struct static_port_map *pm = gw->pm[i];
+
+		for(cs = pm->pool.head; cs != NULL; cs = next)	{
+			next = cs->open_next;
+			if(cs->sess == s)	{
+				remove_cs_list(&pm->pool, cs);
+				free_channel(cs);
 			}
 		}
+		for(cs = pm->ch; cs != NULL; cs = cs->next)
+			if(cs->sess == s)
+				close_later(gw, cs);
+	}
+}
 
-		/* Read any output from ssh and pass it to the client sockets */
-		for(i = 0; outchannels[i] != NULL; i++)	{
-			ssh_channel ch = outchannels[i];
+/**
+ * An established session died, clean up and reconnect
+ *
+ * The listeners stay open throughout, and clients whose opens were in
+ * flight are requeued, to go through another gateway of the pool if it has
+ * a session.  The session itself is freed once the last of its connections
+ * is gone, see reap_sessions().
+ *
+ * @gw		gateway struct
+ * @s		the session that died
+ */
+static void session_lost(struct gw_host *gw, struct gw_session *s)
+{
+	struct gw_member *m = s->member;
 
-			n_read = ssh_channel_read(ch, buf, sizeof(buf), 0);
-			cs = get_cs_for_channel(gw, ch);
+	log_msg("Session to %s lost: %s", m->host, ssh_get_error(s->session));
+	metric_add(&gw->metrics->n_sess_lost, 1);
+	unwatch_session(gw, s);
+	s->state = SESS_FAILED;
+	drop_session_channels(gw, s);
 
-			if(n_read > 0)	{
-				int n_written = 0;
+	if(gw_finishing(gw))
+		return;
+	m->reconnect[s->compressed] = true;
+	if(count_member_sessions(gw, m, s->compressed) == 0)
+		schedule_reconnect(gw, m);
+}
 
-				debug("Read %d bytes from channel %p, write to %d",
-					  n_read, ch, cs->sock_fd);
+/**
+ * Send a keepalive probe on @s, or see whether it has been answered
+ *
+ * The probe is the one OpenSSH's ServerAliveInterval sends, a
+ * "keepalive@openssh.com" global request with want-reply that servers
+ * refuse without complaint.  ssh_send_keepalive() (libssh 0.7.0 and later)
+ * sends it but keeps the reply to itself, so the first read on the session
+ * after the probe (s->rx_at, set by the loop) counts as the answer.  On an
+ * idle session that is the reply, and its time feeds the session's RTT
+ * estimate, smoothed like TCP's (1/8 of each new sample); with channels
+ * open it may be their data, which only shows the session is alive.  Every
+ * keepalive interval without a reply counts as a missed probe, after
+ * keepalive_max of them the session is taken for dead.
+ *
+ * @gw		gateway struct
+ * @s		established session
+ * @now		current monotonic time
+ */
+static void keepalive_session(struct gw_host *gw, struct gw_session *s,
+							  uint64_t now)
+{
+	uint64_t rtt;
 
-				while(n_written < n_read)	{
-					int rc;
-					rc = send(cs->sock_fd, buf, n_read, MSG_NOSIGNAL);
-					if(rc < 0)	{
-						log_msg("Write error on socket %d: %s",
-								cs->sock_fd, strerror(errno));
-						break;
-					}
-					n_written += rc;
-				}
-			} else if (n_read == 0)	{
-				/* close socket */
+	if(s->ka_sent == 0)	{
+		if(now < s->ka_next)
+			return;
+		if(ssh_send_keepalive(s->session) != SSH_OK)	{
+			session_lost(gw, s);
+			return;
+		}
+		s->ka_sent = now;
+		s->ka_idle = (s->n_channels == 0);
+		s->rx_at = 0;
+		return;
+	}
 
-				log_msg("Zero bytes read from channel %p, removing", ch);
-				saferealloc((void **)&channels_to_remove,
-							(n_chan_rm + 1) * sizeof(struct chan_sock *),
-							"removed channels");
+	if(s->rx_at == 0)	{
+		s->ka_missed = (now - s->ka_sent) / gw->keepalive_usec;
+		if(s->ka_missed < gw->keepalive_max)
+			return;
+		log_msg("No keepalive reply from %s in %llu ms", s->member->host,
+				(unsigned long long)((now - s->ka_sent) / 1000));
+		session_lost(gw, s);
+		return;
+	}
 
-				channels_to_remove[n_chan_rm] = cs;
-				n_chan_rm += 1;
-			} else {
-				/* error case */
-				log_msg("Error with ssh_channel_read on channel %p", ch);
-				saferealloc((void **)&channels_to_remove,
-							(n_chan_rm + 1) * sizeof(struct chan_sock *),
-							"removed channels");
+	/* Answered, whether the server liked the request doesn't matter */
+	if(s->ka_idle && s->n_channels == 0)	{
+		rtt = s->rx_at - s->ka_sent;
+		s->rtt_usec = rtt;
+		if(s->srtt_usec == 0)
+			s->srtt_usec = rtt;
+		else
+			s->srtt_usec = s->srtt_usec - s->srtt_usec / 8 + rtt / 8;
+	}
+	s->ka_missed = 0;
+	s->ka_next = s->ka_sent + gw->keepalive_usec;
+	s->ka_sent = 0;
+}
+
+static void keepalive_sessions(struct gw_host *gw)
+{
+	uint64_t now = monotonic_usec();
+	int i;
+
+	for(i = gw->n_sessions - 1; i >= 0; i--)
+		if(gw->sess[i]->state == SESS_UP)
+			keepalive_session(gw, gw->sess[i], now);
+}
+
+/* When the next keepalive is due, or an outstanding one counts as missed */
+static uint64_t next_keepalive(struct gw_host *gw)
+{
+	uint64_t t, first = UINT64_MAX;
+	int i;
+
+	for(i = 0; i < gw->n_sessions; i++)	{
+		struct gw_session *s = gw->sess[i];
+
+		if(s->state != SESS_UP)
+			continue;
+		if(s->ka_sent != 0)
+			t = s->ka_sent + (s->ka_missed + 1) * gw->keepalive_usec;
+		else
+			t = s->ka_next;
+		if(t < first)
+			first = t;
+	}
+	return first;
+}
+
+/* Free dead sessions once nothing refers to them, and bring up sessions
+ * for groups that lost theirs once the gateway's back-off allows */
+static void reap_sessions(struct gw_host *gw)
+{
+	uint64_t now;
+	int i, j;
+
+	for(i = gw->n_sessions - 1; i >= 0; i--)
+		if(gw->sess[i]->state == SESS_FAILED && gw->sess[i]->n_channels == 0)
+			remove_gw_session(gw, gw->sess[i]);
+
+	if(gw_finishing(gw))
+		return;
+	now = monotonic_usec();
+	for(i = 0; i < gw->n_members; i++)
+		for(j = 0; j < 2; j++)
+			if(gw->members[i]->reconnect[j])
+				start_member(gw, gw->members[i], j, now);
+}
+
+/* The earliest a gateway of the pool that is backing off may be retried,
+ * 0 if none is waiting for that */
+static uint64_t next_retry(struct gw_host *gw, bool queued)
+{
+	uint64_t first = 0;
+	int i;
+
+	for(i = 0; i < gw->n_members; i++)	{
+		struct gw_member *m = gw->members[i];
+
+		if((m->reconnect[0] || m->reconnect[1] || queued) &&
+		   (first == 0 || m->retry_at < first))
+			first = m->retry_at;
+	}
+	return first;
+}
+
+/* Take a session that is being set up another step, on I/O or a timeout */
+static void continue_session(struct gw_host *gw, struct gw_session *s)
+{
+	switch(continue_gw_session(gw, s))	{
+		case SSH_OK:
+			session_up(gw, s);
+			break;
+		case SSH_AGAIN:
+			if(monotonic_usec() < s->deadline)
+				break;
+			log_msg("Timed out setting up session to %s", s->member->host);
+			session_failed(gw, s);
+			break;
+		default:
+			session_failed(gw, s);
+			break;
+	}
+}
+
+/* Sessions still coming up get looked at every pass, their socket doesn't
+ * tell us about everything (the TCP connect completing, say) */
+static void continue_sessions(struct gw_host *gw)
+{
+	int i;
+
+	for(i = gw->n_sessions - 1; i >= 0; i--)
+		if(session_starting(gw->sess[i]))
+			continue_session(gw, gw->sess[i]);
+}
+
+static bool sessions_starting(struct gw_host *gw)
+{
+	int i;
+
+	for(i = 0; i < gw->n_sessions; i++)
+		if(session_starting(gw->sess[i]))
+			return true;
+	return false;
+}
+
+/**
+ * Disconnect from the gateway once it has had no clients for idle_timeout
+ *
+ * Pooled channels are dropped along with the sessions, the next client
+ * connects everything again.
+ *
+ * @gw		gateway struct
+ */
+static void close_idle_sessions(struct gw_host *gw)
+{
+	uint64_t now;
+	int i;
 
-				channels_to_remove[n_chan_rm] = cs;
-				n_chan_rm += 1;
+	if(gw->idle_usec == 0 || gw->n_sessions == 0)
+		return;
+	if(gw->n_conns > 0 || gw->opening.n > 0 || gw->open_queue.n > 0 ||
+	   sessions_starting(gw))	{
+		gw->idle_since = 0;
+		return;
+	}
+
+	now = monotonic_usec();
+	if(gw->idle_since == 0)
+		gw->idle_since = now;
+	if(now - gw->idle_since < gw->idle_usec)
+		return;
+
+	log_msg("No clients for %s in %llu s, closing its sessions", gw->name,
+			(unsigned long long)(gw->idle_usec / 1000000));
+	for(i = 0; i < gw->n_maps; i++)
+		while(gw->pm[i]->pool.head != NULL)
+			remove_pooled_channel(gw->pm[i]->pool.head);
+
+	for(i = gw->n_sessions - 1; i >= 0; i--)	{
+		struct gw_session *s = gw->sess[i];
+
+		if(s->n_channels > 0)
+			continue;
+		unwatch_session(gw, s);
+		remove_gw_session(gw, s);
+	}
+	gw->idle_since = 0;
+}
+
+/* Maps dropped from the config go once their last connection has */
+static void reap_drained_maps(struct gw_host *gw)
+{
+	int i;
+
+	for(i = gw->n_maps - 1; i >= 0; i--)	{
+		struct static_port_map *pm = gw->pm[i];
+
+		if(pm->draining && pm->n_channels == 0)	{
+			debug("Map %d drained, removing it", pm->local_port);
+			remove_map_from_gw(pm);
+		}
+	}
+}
+
+/* Set up @gw to be driven by gw_loop_iter(), from whichever thread runs it.
+ * No session is connected until the first client needs one. */
+void gw_loop_start(struct gw_host *gw)
+{
+	setup_channel_callbacks(gw);
+	gw->pool_short = true;
+	gw->stats_seen = __atomic_load_n(&stats_requests, __ATOMIC_RELAXED);
+}
+
+/* How long the gateway can wait for events before it has work to do */
+int gw_loop_timeout(struct gw_host *gw)
+{
+	struct chan_sock *cs;
+	uint64_t now, first = UINT64_MAX;
+	int t = gw_finishing(gw) ? 250 : 5000;
+
+	if(gw->ready != NULL)
+		return 0;
+
+	now = monotonic_usec();
+	/* Wake up for the first coalescing deadline, rounded up to a ms */
+	if(gw->coalescing != NULL)	{
+		for(cs = gw->coalescing; cs != NULL; cs = cs->co_next)
+			if(cs->flush_at < first)
+				first = cs->flush_at;
+		if(first <= now)
+			return 0;
+		if((first - now + 999) / 1000 < t)
+			t = (first - now + 999) / 1000;
+	}
+	if(gw->n_paused > 0 && ACCEPT_PAUSE_USEC / 1000 < t)
+		t = ACCEPT_PAUSE_USEC / 1000;
+	if(SESS_POLL_MS < t && sessions_starting(gw))
+		t = SESS_POLL_MS;
+	/* Reconnect when the back-off is over, and check on held clients */
+	first = next_retry(gw, gw->open_queue.n > 0);
+	if(first > now && (first - now) / 1000 + 1 < t)
+		t = (first - now) / 1000 + 1;
+	if((gw->open_queue.n > 0 || gw->n_be_down > 0) && 1000 < t)
+		t = 1000;
+	if(gw->idle_since > 0 && gw->idle_since + gw->idle_usec > now &&
+	   (gw->idle_since + gw->idle_usec - now) / 1000 + 1 < t)
+		t = (gw->idle_since + gw->idle_usec - now) / 1000 + 1;
+	if(gw->keepalive_usec > 0 && gw->n_sessions > 0)	{
+		first = next_keepalive(gw);
+		if(first <= now)
+			return 0;
+		if((first - now) / 1000 + 1 < t)
+			t = (first - now) / 1000 + 1;
+	}
+	return t;
+}
+
+/**
+ * Run one pass of the gateway's loop
+ *
+ * Waits up to @timeout ms for events on the gateway's own descriptors,
+ * handles them and then does the per-pass work on channels, opens and pools.
+ *
+ * @gw		gateway struct
+ * @timeout	ms to wait for events, 0 to only take what is ready already
+ * @buf		scratch buffer, CHAN_BUF_SIZE is a good size
+ * @len		size of @buf
+ * @return	true once the gateway is shutting down and has no connections
+ */
+bool gw_loop_iter(struct gw_host *gw, int timeout, char *buf, size_t len)
+{
+	int i, n_ready;
+	bool session_io, done = false;
+	struct chan_sock *cs;
+	sig_atomic_t stats_req;
+
+	gw->pass++;
+	stats_req = __atomic_load_n(&stats_requests, __ATOMIC_RELAXED);
+	if(gw->stats_seen != stats_req)	{
+		gw->stats_seen = stats_req;
+		log_gw_stats(gw);
+	}
+	if(gw_finishing(gw))	{
+		int n_chans = 0;
+		/* Free the ports now, a replacement may be waiting for them */
+		for(i = 0; i < gw->n_maps; i++)	{
+			close_map_listener(gw->pm[i]);
+			n_chans += gw->pm[i]->n_channels;
+		}
+		if(n_chans == 0)
+			done = true;
+	}
+
+	if((n_ready = event_wait(gw->ev, timeout)) < 0)	{
+		debug("epoll_wait() gave EINTR");
+		return done;
+	}
+
+	session_io = (n_ready == 0);
+	/* Only the descriptors that are actually ready are returned, see if
+	 * there are any new connections or reads waiting and perform them
+	 */
+	for(i = 0; i < n_ready; i++)	{
+		int fd = gw->ev->events[i].data.fd;
+		uint32_t events = gw->ev->events[i].events;
+		struct static_port_map *pm;
+		struct gw_session *s;
+
+		/* Let libssh read/flush the socket, callbacks mark channels ready */
+		if((s = get_session_for_fd(gw, fd)) != NULL)	{
+			if(s->state != SESS_UP)	{
+				continue_session(gw, s);
+				continue;
+			}
+			/* The first read after a keepalive probe is taken as its reply */
+			if(s->ka_sent != 0 && s->rx_at == 0 && (events & EPOLLIN))
+				s->rx_at = monotonic_usec();
+			if(events & (EPOLLERR | EPOLLHUP) ||
+			   ssh_event_dopoll(s->ssh_ev, 0) == SSH_ERROR)
+				session_lost(gw, s);
+			session_io = true;
+			continue;
+		}
+
+		/* On connect, take what's queued (up to a budget) and add channels */
+		if((pm = get_map_for_listening(gw, fd)) != NULL)	{
+			int n;
+
+			if(gw_finishing(gw))	{
+				event_del(gw->ev, fd);
+				continue;
 			}
+			for(n = 0; n < ACCEPT_BUDGET; n++)
+				if(new_connection(gw, pm) < 0)
+					break;
+			continue;
 		}
-		if(n_chan_rm > 0)	{
-			for(i = 0; i < n_chan_rm; i++)
-				remove_channel_from_map(channels_to_remove[i]);
-			free(channels_to_remove);
+
+		/* Otherwise it's a client socket */
+		if((cs = get_chan_for_fd(gw, fd)) == NULL)
+			log_exit(FATAL_ERROR, "Error: fd %d channel not found", fd);
+		if(!cs->closing)
+			client_event(gw, cs, events, buf, len);
+	}
+
+	if(gw->n_sessions > 0)
+		continue_sessions(gw);
+	if(gw->keepalive_usec > 0 && gw->n_sessions > 0)
+		keepalive_sessions(gw);
+	process_ready_channels(gw, buf, len);
+	if(gw->coalescing != NULL)
+		process_coalesced(gw);
+	if(gw->opening.n > 0 || gw->open_queue.n > 0)
+		process_channel_opens(gw, session_io);
+	fill_pools(gw);
+	if(gw->n_be_down > 0 && !gw_finishing(gw))
+		probe_backends(gw);
+
+	remove_closed_channels(gw);
+	reap_drained_maps(gw);
+	resume_listeners(gw);
+	if(gw->n_sessions > 0 || next_retry(gw, false) > 0)
+		reap_sessions(gw);
+	close_idle_sessions(gw);
+	update_session_events(gw);
+	return done;
+}
+
+void gw_loop_end(struct gw_host *gw)
+{
+	int i;
+
+	debug("Exiting main loop for %s...", gw->name);
+	for(i = 0; i < gw->n_sessions; i++)
+		unwatch_session(gw, gw->sess[i]);
+}
+
+int select_loop(struct gw_host *gw)
+{
+	char *buf = safemalloc(CHAN_BUF_SIZE, "channel scratch buffer");
+
+	gw_loop_start(gw);
+
+	/* This is the program's main loop right here */
+	while(!hard_shutdown && !gw_loop_iter(gw, gw_loop_timeout(gw),
+										   buf, CHAN_BUF_SIZE))	{
+		if(reload_config)	{
+			reload_config = false;
+			reload_gateway(gw);
 		}
 	}
 
-	debug("Exiting main loop...");
-	free(channels);
-	free(outchannels);
+	gw_loop_end(gw);
+	free(buf);
 	return 0;
 }
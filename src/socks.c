@@ -0,0 +1,232 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "util.h"
+#include "socks.h"
+
+/*
+ * Incremental SOCKS4/4a/5 server handshake.  The caller appends whatever the
+ * client sent to ss->buf and calls socks_input(), which never blocks: it
+ * either needs more bytes, produces a reply to send, finds the destination
+ * or fails.  Only CONNECT without authentication is supported, and names are
+ * passed to the gateway unresolved so it does the lookup.
+ */
+
+enum socks_phase {
+	SP_GREETING,
+	SP_REQUEST,
+	SP_DONE,
+};
+
+#define SOCKS5_REP_OK		0x00
+#define SOCKS5_REP_FAIL		0x01
+#define SOCKS5_REP_REFUSED	0x05
+#define SOCKS5_REP_BADCMD	0x07
+#define SOCKS5_REP_BADADDR	0x08
+#define SOCKS4_REP_OK		0x5a
+#define SOCKS4_REP_FAIL		0x5b
+
+static void socks5_reply(char *reply, size_t *reply_len, int rep)
+{
+	/* VER REP RSV ATYP=IPv4 0.0.0.0:0 */
+	memset(reply, 0, 10);
+	reply[0] = 5;
+	reply[1] = rep;
+	reply[3] = 1;
+	*reply_len = 10;
+}
+
+static void socks4_reply(char *reply, size_t *reply_len, int rep)
+{
+	memset(reply, 0, 8);
+	reply[1] = rep;
+	*reply_len = 8;
+}
+
+/* Find a NUL-terminated string in @b from @off, -1 if not complete yet */
+static long find_nul(const unsigned char *b, size_t off, size_t len)
+{
+	const unsigned char *p = memchr(b + off, '\0', len - off);
+	return (p == NULL) ? -1 : p - b;
+}
+
+static int socks4_request(struct socks_state *ss, char *reply, size_t *reply_len)
+{
+	const unsigned char *b = ss->buf;
+	long user_end, host_end;
+
+	if(ss->len < 9)
+		return SOCKS_MORE;
+
+	if(b[1] != 1)	{
+		socks4_reply(reply, reply_len, SOCKS4_REP_FAIL);
+		return SOCKS_FAIL;
+	}
+
+	ss->port = (b[2] << 8) | b[3];
+	if((user_end = find_nul(b, 8, ss->len)) < 0)
+		return SOCKS_MORE;
+
+	/* SOCKS4a: 0.0.0.x with x != 0 means a hostname follows the user id */
+	if(b[4] == 0 && b[5] == 0 && b[6] == 0 && b[7] != 0)	{
+		if((host_end = find_nul(b, user_end + 1, ss->len)) < 0)
+			return SOCKS_MORE;
+		if(host_end - user_end - 1 >= sizeof(ss->host) ||
+		   host_end == user_end + 1)	{
+			socks4_reply(reply, reply_len, SOCKS4_REP_FAIL);
+			return SOCKS_FAIL;
+		}
+		memcpy(ss->host, b + user_end + 1, host_end - user_end - 1);
+		ss->host[host_end - user_end - 1] = '\0';
+		ss->used = host_end + 1;
+	} else {
+		inet_ntop(AF_INET, b + 4, ss->host, sizeof(ss->host));
+		ss->used = user_end + 1;
+	}
+	return SOCKS_DONE;
+}
+
+static int socks5_greeting(struct socks_state *ss, char *reply, size_t *reply_len)
+{
+	const unsigned char *b = ss->buf;
+	size_t need;
+
+	if(ss->len < 2)
+		return SOCKS_MORE;
+	need = 2 + b[1];
+	if(ss->len < need)
+		return SOCKS_MORE;
+
+	reply[0] = 5;
+	*reply_len = 2;
+	if(memchr(b + 2, 0x00, b[1]) == NULL)	{
+		reply[1] = (char)0xff;
+		return SOCKS_FAIL;
+	}
+	reply[1] = 0x00;
+
+	/* Drop the greeting, the request may already be behind it */
+	ss->len -= need;
+	memmove(ss->buf, ss->buf + need, ss->len);
+	ss->phase = SP_REQUEST;
+	return SOCKS_MORE;
+}
+
+static int socks5_request(struct socks_state *ss, char *reply, size_t *reply_len)
+{
+	const unsigned char *b = ss->buf;
+	size_t addr_len, need;
+
+	if(ss->len < 5)
+		return SOCKS_MORE;
+
+	switch(b[3])	{
+		case 1:
+			addr_len = 4;
+			break;
+		case 3:
+			addr_len = 1 + b[4];
+			break;
+		case 4:
+			addr_len = 16;
+			break;
+		default:
+			socks5_reply(reply, reply_len, SOCKS5_REP_BADADDR);
+			return SOCKS_FAIL;
+	}
+	need = 4 + addr_len + 2;
+	if(ss->len < need)
+		return SOCKS_MORE;
+
+	if(b[0] != 5 || b[1] != 1)	{
+		socks5_reply(reply, reply_len, SOCKS5_REP_BADCMD);
+		return SOCKS_FAIL;
+	}
+
+	switch(b[3])	{
+		case 1:
+			inet_ntop(AF_INET, b + 4, ss->host, sizeof(ss->host));
+			break;
+		case 3:
+			if(b[4] == 0)	{
+				socks5_reply(reply, reply_len, SOCKS5_REP_BADADDR);
+				return SOCKS_FAIL;
+			}
+			memcpy(ss->host, b + 5, b[4]);
+			ss->host[b[4]] = '\0';
+			break;
+		case 4:
+			inet_ntop(AF_INET6, b + 4, ss->host, sizeof(ss->host));
+			break;
+	}
+	ss->port = (b[4 + addr_len] << 8) | b[4 + addr_len + 1];
+	ss->used = need;
+	return SOCKS_DONE;
+}
+
+/**
+ * Feed the bytes accumulated in ss->buf to the handshake
+ *
+ * @ss			Handshake state, ss->len bytes of client input in ss->buf
+ * @reply		Filled with bytes to send to the client (SOCKS_REPLY_MAX)
+ * @reply_len	Set to the length of @reply, 0 if nothing to send
+ * @return		SOCKS_MORE if more input is needed, SOCKS_DONE once the
+ *				destination is in ss->host/ss->port (ss->used bytes of the
+ *				buffer belong to the handshake, the rest is client data),
+ *				SOCKS_FAIL if the client should be sent @reply and dropped
+ */
+int socks_input(struct socks_state *ss, char *reply, size_t *reply_len)
+{
+	int rv = SOCKS_MORE;
+
+	*reply_len = 0;
+
+	if(ss->len == 0)
+		return SOCKS_MORE;
+
+	if(ss->phase == SP_GREETING)	{
+		ss->version = ss->buf[0];
+		switch(ss->version)	{
+			case 4:
+				ss->phase = SP_REQUEST;
+				break;
+			case 5:
+				rv = socks5_greeting(ss, reply, reply_len);
+				if(rv != SOCKS_MORE || ss->phase == SP_GREETING)
+					return rv;
+				break;
+			default:
+				return SOCKS_FAIL;
+		}
+	}
+
+	/* A request can come in the same read as the greeting, reply to both */
+	if(ss->phase == SP_REQUEST)	{
+		size_t greet_len = *reply_len, req_len = 0;
+
+		if(ss->version == 4)
+			rv = socks4_request(ss, reply + greet_len, &req_len);
+		else
+			rv = socks5_request(ss, reply + greet_len, &req_len);
+		*reply_len = greet_len + req_len;
+	}
+
+	if(rv == SOCKS_DONE)
+		ss->phase = SP_DONE;
+	else if(rv == SOCKS_MORE && ss->len == sizeof(ss->buf))
+		rv = SOCKS_FAIL;
+
+	return rv;
+}
+
+/* Final reply to the client once the gateway has answered the channel open */
+void socks_result(struct socks_state *ss, bool ok, char *reply, size_t *reply_len)
+{
+	if(ss->version == 4)
+		socks4_reply(reply, reply_len, ok ? SOCKS4_REP_OK : SOCKS4_REP_FAIL);
+	else
+		socks5_reply(reply, reply_len, ok ? SOCKS5_REP_OK : SOCKS5_REP_REFUSED);
+}
@@ -4,67 +4,233 @@
 
 #include "ssh.h"
 
-void connect_ssh_session(ssh_session session)
+/* A server we can't verify is only refused if the key is known to differ */
+static int check_known_host(ssh_session session)
 {
-	if(ssh_connect(session) != SSH_OK)
-		log_exit(CONNECTION_ERROR, "Error connecting to host: %s", ssh_get_error(session));
-
 	switch(ssh_session_is_known_server(session))	{
 		case SSH_KNOWN_HOSTS_OK:
 		case SSH_KNOWN_HOSTS_UNKNOWN:
 		case SSH_KNOWN_HOSTS_NOT_FOUND:
-			break;
+			return SSH_OK;
 		case SSH_KNOWN_HOSTS_ERROR:
-			log_exit(CONNECTION_ERROR, "SSH Server error with session: %s",
-					 ssh_get_error(session));
+			log_msg("SSH Server error with session: %s", ssh_get_error(session));
+			return SSH_ERROR;
 		default:
-			log_exit(CONNECTION_RETRY, "Unknown error validating server");
+			log_msg("Unknown error validating server");
+			return SSH_ERROR;
 	}
 }
 
-static void pubkey_auth(ssh_session session, const char *privkey)
+/* The private key is read once, then every session authenticates with it */
+static int load_auth_key(struct gw_host *gw)
 {
-	char pubkey[strlen(privkey) + 5];
-	ssh_key k_pub, k_priv;
-	
-	sprintf(pubkey, "%s.pub", privkey);
-	if(ssh_pki_import_pubkey_file(pubkey, &k_pub) != SSH_OK)
-		log_exit(CONNECTION_ERROR, "Import public key %s: %s", 
-				 pubkey, ssh_get_error(session));
-	if(ssh_userauth_try_publickey(session, NULL, k_pub) != SSH_AUTH_SUCCESS)
-		log_exit(CONNECTION_ERROR, "Public key %s rejected", pubkey);
-	if(ssh_pki_import_privkey_file(privkey, NULL, NULL, NULL, &k_priv) != SSH_OK)
-		log_exit(CONNECTION_ERROR, "Import private key %s: %s", 
-				 privkey, ssh_get_error(session));
-	if(ssh_userauth_publickey(session, NULL, k_priv) != SSH_AUTH_SUCCESS)
-		log_exit(CONNECTION_ERROR, "Connecting with private key %s: %s", 
-				 privkey, ssh_get_error(session));
-	
-	ssh_key_free(k_pub);
-	ssh_key_free(k_priv);
+	if(gw->auth_key != NULL)
+		return SSH_OK;
+
+	if(ssh_pki_import_privkey_file(gw->auth, NULL, NULL, NULL,
+								   &gw->auth_key) != SSH_OK)	{
+		log_msg("Import private key %s failed", gw->auth);
+		gw->auth_key = NULL;
+		return SSH_ERROR;
+	}
+	return SSH_OK;
 }
 
-void authenticate_ssh_session(ssh_session session, const char *key)
+/* One step of authentication, SSH_AGAIN until the server has answered */
+static int auth_step(struct gw_host *gw, struct gw_session *s)
 {
-	if(key != NULL)
-		pubkey_auth(session, key);
-	else	{
-		/* This will only work if you are running ssh-agent */
-		switch(ssh_userauth_agent(session, NULL))	{
-			case SSH_AUTH_SUCCESS:
-				break;
-			case SSH_AUTH_ERROR:
-				log_exit(CONNECTION_ERROR, "Error occured authenticating: %s",
-						ssh_get_error(session));
-			default:
-				log_exit(CONNECTION_ERROR, "Error: Not authenticated to server");
+	int rc;
+
+	/* Agent-based unless a key file was configured */
+	if(gw->auth != NULL)	{
+		if(load_auth_key(gw) != SSH_OK)
+			return SSH_ERROR;
+		rc = ssh_userauth_publickey(s->session, NULL, gw->auth_key);
+	} else {
+		rc = ssh_userauth_agent(s->session, NULL);
+	}
+
+	switch(rc)	{
+		case SSH_AUTH_SUCCESS:
+			return SSH_OK;
+		case SSH_AUTH_AGAIN:
+			return SSH_AGAIN;
+		case SSH_AUTH_ERROR:
+			log_msg("Error occured authenticating to %s: %s", s->member->host,
+					ssh_get_error(s->session));
+			return SSH_ERROR;
+		default:
+			log_msg("Error: Not authenticated to %s%s%s", s->member->host,
+					gw->auth ? " with key " : "", gw->auth ? gw->auth : "");
+			return SSH_ERROR;
+	}
+}
+
+/**
+ * Move a session that is being set up along as far as it will go
+ *
+ * Connecting, key exchange and authentication all run non-blocking, this is
+ * called whenever the session socket is ready (and periodically) until it
+ * returns something other than SSH_AGAIN.
+ *
+ * @gw		gateway the session belongs to
+ * @s		session in SESS_CONNECTING or SESS_AUTHENTICATING
+ * @return	SSH_OK once authenticated, SSH_AGAIN or SSH_ERROR
+ */
+int continue_gw_session(struct gw_host *gw, struct gw_session *s)
+{
+	int rc;
+
+	if(s->state == SESS_CONNECTING)	{
+		rc = ssh_connect(s->session);
+		if(s->fd < 0)
+			s->fd = ssh_get_fd(s->session);
+		if(rc == SSH_AGAIN)
+			return SSH_AGAIN;
+		if(rc != SSH_OK)	{
+			log_msg("Error connecting to %s: %s", s->member->host,
+					ssh_get_error(s->session));
+			return SSH_ERROR;
 		}
+		if(check_known_host(s->session) != SSH_OK)
+			return SSH_ERROR;
+		s->state = SESS_AUTHENTICATING;
 	}
+
+	if(s->state == SESS_AUTHENTICATING)	{
+		if((rc = auth_step(gw, s)) != SSH_OK)
+			return rc;
+		s->state = SESS_UP;
+		debug("Session to %s established%s", s->member->host,
+			  s->compressed ? " (compressed)" : "");
+	}
+	return SSH_OK;
+}
+
+/* Number of live sessions in the compressed or the plain group, failed ones
+ * waiting for their channels to go are not counted */
+int count_gw_sessions(struct gw_host *gw, bool compressed)
+{
+	int i, n = 0;
+
+	for(i = 0; i < gw->n_sessions; i++)
+		if(gw->sess[i]->compressed == compressed &&
+		   gw->sess[i]->state != SESS_FAILED)
+			n++;
+	return n;
+}
+
+/* The same, only counting the sessions to one gateway of the pool */
+int count_member_sessions(struct gw_host *gw, struct gw_member *m,
+						  bool compressed)
+{
+	int i, n = 0;
+
+	for(i = 0; i < gw->n_sessions; i++)
+		if(gw->sess[i]->member == m && gw->sess[i]->compressed == compressed &&
+		   gw->sess[i]->state != SESS_FAILED)
+			n++;
+	return n;
+}
+
+/**
+ * Add a gateway host to the section's pool
+ *
+ * The member's template is a copy of the section's, with its own host set.
+ * Members are only added while the config is read, before any session.
+ *
+ * @gw		gateway (pool) to add to, its template session fully set up
+ * @host	host name, as for ssh: [user@]host[:port]
+ */
+void add_gw_member(struct gw_host *gw, const char *host)
+{
+	struct gw_member *m = safemalloc(sizeof(struct gw_member), "gw member");
+
+	m->host = safestrdup(host, "gw member host");
+	if(ssh_options_copy(gw->session, &m->session) != 0)
+		log_exit(CONNECTION_ERROR, "Error copying options for %s", host);
+	if(ssh_options_set(m->session, SSH_OPTIONS_HOST, host) != SSH_OK)
+		log_exit(CONFIG_ERROR, "Error: invalid gateway host '%s'", host);
+
+	saferealloc((void **)&gw->members, (gw->n_members + 1) * sizeof(m),
+				"gw member array");
+	gw->members[gw->n_members++] = m;
+}
+
+/**
+ * Start one more session to a gateway of the pool
+ *
+ * Each session gets a copy of the options the config was applied to, the
+ * template itself is never connected.  The connect is started non-blocking
+ * and the session is added to gw->sess, continue_gw_session() does the rest
+ * once the main loop sees the socket.
+ *
+ * @gw			gateway to add a session to
+ * @m			which host of the gateway's pool to connect to
+ * @compressed	whether the session negotiates zlib compression
+ * @return		The new session, in SESS_CONNECTING or SESS_FAILED
+ */
+struct gw_session *add_gw_session(struct gw_host *gw, struct gw_member *m,
+								  bool compressed)
+{
+	struct gw_session *s = safemalloc(sizeof(struct gw_session), "gw session");
+
+	if(ssh_options_copy(m->session, &s->session) != 0)
+		log_exit(CONNECTION_ERROR, "Error copying options for new session to %s",
+				 m->host);
+	s->member = m;
+
+	ssh_options_set(s->session, SSH_OPTIONS_COMPRESSION, compressed ? "yes" : "no");
+	if(compressed)
+		ssh_options_set(s->session, SSH_OPTIONS_COMPRESSION_LEVEL, &gw->comp_level);
+	s->compressed = compressed;
+	s->fd = -1;
+	s->state = SESS_CONNECTING;
+	s->deadline = monotonic_usec() + SESS_SETUP_USEC;
+	ssh_set_blocking(s->session, 0);
+
+	saferealloc((void **)&gw->sess, (gw->n_sessions + 1) * sizeof(s),
+				"gw session array");
+	gw->sess[gw->n_sessions++] = s;
+	debug("Connecting session %d to %s%s", gw->n_sessions, m->host,
+		  compressed ? " (compressed)" : "");
+
+	if(continue_gw_session(gw, s) == SSH_ERROR || s->fd < 0)
+		s->state = SESS_FAILED;
+	return s;
+}
+
+/* Take @s out of gw->sess and close it, it must have no channels left */
+void remove_gw_session(struct gw_host *gw, struct gw_session *s)
+{
+	int i;
+
+	for(i = 0; i < gw->n_sessions; i++)
+		if(gw->sess[i] == s)
+			break;
+	if(i == gw->n_sessions)
+		log_exit(FATAL_ERROR, "Error: session %p not found on %s", s, gw->name);
+
+	for(; i < gw->n_sessions - 1; i++)
+		gw->sess[i] = gw->sess[i + 1];
+	gw->n_sessions--;
+
+	if(s->state == SESS_UP && ssh_is_connected(s->session))
+		ssh_disconnect(s->session);
+	ssh_free(s->session);
+	free(s);
 }
 
-void end_ssh_session(ssh_session session)
+/**
+ * May another session to @m be added to the group?
+ *
+ * @gw			gateway struct
+ * @m			gateway of the pool
+ * @compressed	the group, compressed or plain sessions
+ * @return		true if @m's sessions in the group are under max_sessions
+ */
+bool can_add_gw_session(struct gw_host *gw, struct gw_member *m,
+						bool compressed)
 {
-	if(ssh_is_connected(session))
-		ssh_disconnect(session);
-	ssh_free(session);
+	return count_member_sessions(gw, m, compressed) < gw->max_sessions;
 }
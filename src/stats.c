@@ -0,0 +1,152 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "autotun.h"
+#include "port_map.h"
+#include "stats.h"
+
+volatile sig_atomic_t dump_stats = false;
+
+/* Bumped for each stats request, every gateway logs once per change */
+volatile sig_atomic_t stats_requests = 0;
+
+static const char *sess_states[] = {
+	"connecting", "authenticating", "up", "failed"
+};
+
+/* The read sizes the map's live connections have settled on */
+static void log_read_sizes(struct static_port_map *pm)
+{
+	struct chan_sock *cs;
+	uint64_t rd_sum = 0, chan_sum = 0;
+	uint32_t rd_max = 0, chan_max = 0;
+
+	if(pm->n_channels == 0)
+		return;
+
+	for(cs = pm->ch; cs != NULL; cs = cs->next)	{
+		rd_sum += cs->rd_size;
+		chan_sum += cs->chan_rd_size;
+		if(cs->rd_size > rd_max)
+			rd_max = cs->rd_size;
+		if(cs->chan_rd_size > chan_max)
+			chan_max = cs->chan_rd_size;
+	}
+	log_msg("  %u read sizes (max %d): client avg %llu max %u, "
+			"channel avg %llu max %u", pm->local_port, pm->opts.max_read,
+			(unsigned long long)(rd_sum / pm->n_channels), rd_max,
+			(unsigned long long)(chan_sum / pm->n_channels), chan_max);
+}
+
+/* The ratio is what an order-0 coder would get on the sampled bytes, zlib
+ * does better on text but it tells compressible data from the rest */
+static void log_compression(struct static_port_map *pm)
+{
+	static const char *modes[] = { "off", "on", "auto" };
+
+	if(pm->entropy < 0)	{
+		log_msg("  %u compression %s, %u bytes sampled", pm->local_port,
+				modes[pm->opts.compression],
+				pm->sample ? pm->sample->n : 0);
+		return;
+	}
+	log_msg("  %u compression %s%s, entropy %.2f bits/byte, est. ratio %.2f",
+			pm->local_port, modes[pm->opts.compression],
+			pm->opts.compression != COMP_AUTO ? "" :
+			(pm->compress ? " (on)" : " (off)"), pm->entropy,
+			pm->entropy > 0 ? 8.0 / pm->entropy : 8.0);
+}
+
+/* Only for maps with several backends, a single one is never taken out */
+static void log_backends(struct static_port_map *pm)
+{
+	int i;
+
+	for(i = 0; i < pm->n_be; i++)	{
+		struct backend *be = pm->be[i];
+
+		if(be->removed && be->n_channels == 0)
+			continue;
+		log_msg("  %u backend %s:%u%s: %d active, %llu opened, %llu failed",
+				pm->local_port, be->host, be->port,
+				be->removed ? " (removed)" : (be->down ? " (down)" : ""),
+				be->n_channels, (unsigned long long)be->n_opened,
+				(unsigned long long)be->n_failed);
+	}
+}
+
+/**
+ * Write the counters for every map on the gateway to the log
+ *
+ * Triggered by SIGUSR2, which the parent forwards to all gateway children
+ * (or, with worker threads, every worker sees for each of its gateways).
+ *
+ * @gw		The gateway to report on
+ */
+void log_gw_stats(struct gw_host *gw)
+{
+	int i;
+
+	log_msg("Stats for %s (shard %d): %d maps, %d/%d connections, "
+			"%d channel opens in flight, %d queued", gw->name, gw->shard,
+			gw->n_maps, gw->n_conns, gw->max_conns, gw->opening.n,
+			gw->open_queue.n);
+
+	if(gw->n_sessions == 0)
+		log_msg("  not connected");
+	for(i = 0; i < gw->n_members; i++)
+		if(gw->members[i]->backoff_usec > 0)
+			log_msg("  %s reconnecting, back-off %llu ms", gw->members[i]->host,
+					(unsigned long long)(gw->members[i]->backoff_usec / 1000));
+	for(i = 0; i < gw->n_sessions; i++)	{
+		struct gw_session *s = gw->sess[i];
+
+		log_msg("  session %d to %s %s: %d channels, limit %d%s", i,
+				s->member->host, sess_states[s->state], s->n_channels,
+				s->chan_limit, s->compressed ? ", compressed" : "");
+		if(s->srtt_usec > 0)
+			log_msg("  session %d rtt %llu us (last %llu us), "
+					"%d keepalives missed", i,
+					(unsigned long long)s->srtt_usec,
+					(unsigned long long)s->rtt_usec, s->ka_missed);
+	}
+
+	for(i = 0; i < gw->n_maps; i++)	{
+		struct static_port_map *pm = gw->pm[i];
+		struct metric_counters *st = &pm->metrics->c;
+
+		log_msg("  %u -> %s:%u%s: %llu accepted, %d active, "
+				"pool %d/%d (%llu hits), %llu opened, %llu failed, "
+				"open latency avg %llu us p99 <= %llu us",
+				pm->local_port, pm->remote_host, pm->remote_port,
+				pm->draining ? " (draining)" : "",
+				(unsigned long long)st->n_accepted, pm->n_channels,
+				pm->pool.n, pm->opts.pool_size,
+				(unsigned long long)st->n_pool_hits,
+				(unsigned long long)st->n_opened,
+				(unsigned long long)st->n_open_failed,
+				(unsigned long long)(st->n_opened ?
+									 st->open_usec / st->n_opened : 0),
+				(unsigned long long)metrics_p99_usec(st->open_hist,
+													 st->n_opened));
+		if(pm->n_be > 1)
+			log_backends(pm);
+		log_read_sizes(pm);
+		log_compression(pm);
+		if(pm->opts.coalesce_usec > 0)
+			log_msg("  %u coalesced %llu small reads, %llu flushes",
+					pm->local_port, (unsigned long long)st->n_coalesced,
+					(unsigned long long)st->n_co_flushes);
+		log_msg("  %u overload: %d/%d connections%s, paused %llu times, "
+				"%llu shed and %llu left queued for lack of fds",
+				pm->local_port, pm->n_channels, pm->opts.max_conns,
+				pm->paused ? " (paused)" : "",
+				(unsigned long long)st->n_paused,
+				(unsigned long long)st->n_shed,
+				(unsigned long long)st->n_fd_full);
+		log_msg("  %u gateway down: %llu turned away, %llu held too long",
+				pm->local_port, (unsigned long long)st->n_hold_full,
+				(unsigned long long)st->n_hold_expired);
+	}
+}
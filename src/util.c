@@ -7,67 +7,472 @@
 #include <time.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <stdint.h>
+#include <signal.h>
+#include <pthread.h>
 
 #include "util.h"
 
 FILE *debug_stream = NULL;
 
-static inline void log_msg_init(void)
+/* Longer lines are cut short */
+#define LOG_LINE_MAX 1024
+/* Lines the flush thread may fall behind by before new ones are dropped */
+#define LOG_RING_SLOTS 1024
+/* What the flush thread gathers into one write() */
+#define LOG_BATCH (64 * 1024)
+/* How long the flush thread sleeps once the ring is empty */
+#define LOG_FLUSH_NSEC (10 * 1000 * 1000)
+/* log_error() lets this many of one message through a second, the rest
+ * are counted and reported when the second is over */
+#define LOG_REPEAT_MAX 10
+/* Messages tracked for that at once, more are never held back */
+#define LOG_LIMITS 16
+
+/* One line in the ring.  seq == position: free for the producer claiming it,
+ * seq == position + 1: filled, for the flush thread */
+struct log_cell {
+	uint64_t seq;
+	size_t len;
+	char line[LOG_LINE_MAX];
+};
+
+static struct log_cell *log_ring = NULL;
+static uint64_t ring_head;		/* Next to fill, claimed by CAS */
+static uint64_t ring_tail;		/* Next to write, the flush thread's own */
+static uint64_t n_dropped;
+static bool log_async = false;
+static bool log_stopping = false;
+static pthread_t flush_thread;
+
+/* The prefix only changes once a second, each thread keeps its own.  Set
+ * by log_clock() on the way into every logging call. */
+static __thread time_t stamp_sec = -1;
+static __thread char stamp[32];
+
+/* A message is its format string, so a flood from one call site counts
+ * whatever its arguments.  Claimed and counted with atomics only, a
+ * message logged from many threads never has them wait on each other. */
+struct log_limit {
+	const char *fmt;
+	uint64_t win;			/* Second << 32 | messages in it */
+	unsigned int held;
+};
+
+static struct log_limit limits[LOG_LIMITS];
+static unsigned int n_held;
+
+/* Whole lines in one write(2), the processes sharing a log file (O_APPEND)
+ * then never cut into each other's lines as buffered stdio would */
+static void write_lines(const char *p, size_t len)
+{
+	int fd = fileno(debug_stream);
+	ssize_t n;
+
+	while(len > 0)	{
+		if((n = write(fd, p, len)) < 0)	{
+			if(errno == EINTR)
+				continue;
+			return;
+		}
+		p += n;
+		len -= n;
+	}
+}
+
+/* Read the clock once for a logging call, the thread's stamp follows it */
+static void log_clock(void)
 {
-	char p[64];
 	time_t t = time(NULL);
+	struct tm tm;
+
+	if(t != stamp_sec)	{
+		if(strftime(stamp, sizeof(stamp), "%m/%d %X", localtime_r(&t, &tm)) == 0)
+			stamp[0] = '\0';
+		stamp_sec = t;
+	}
+}
+
+/* Time as of the last log_clock() and program name into @buf, its length
+ * is returned */
+static size_t log_prefix(char *buf, size_t size)
+{
+	int n;
+
+	n = snprintf(buf, size, "%s %s: ", stamp, prog_name);
+	return (n < 0) ? 0 : ((size_t)n < size ? (size_t)n : size - 1);
+}
+
+/**
+ * Format one log line, newline-terminated, into @line
+ *
+ * @line	buffer of LOG_LINE_MAX
+ * @err		appended after ": " unless NULL, for the perror variants
+ * @return	length of the line
+ */
+static size_t format_line(char *line, const char *err, const char *fmt,
+						  va_list ap)
+{
+	size_t n, room;
+	int m;
+
+	/* One byte is kept for the newline */
+	n = log_prefix(line, LOG_LINE_MAX - 1);
+	room = LOG_LINE_MAX - 1 - n;
+	m = vsnprintf(line + n, room, fmt, ap);
+	if(m > 0)
+		n += ((size_t)m < room) ? (size_t)m : room - 1;
+	if(err != NULL)	{
+		room = LOG_LINE_MAX - 1 - n;
+		m = snprintf(line + n, room, ": %s", err);
+		if(m > 0)
+			n += ((size_t)m < room) ? (size_t)m : room - 1;
+	}
+	line[n++] = '\n';
+	return n;
+}
+
+/**
+ * Queue a line for the flush thread
+ *
+ * @shed	drop the line if the ring is full, else wait for room
+ */
+static void ring_push(const char *line, size_t len, bool shed)
+{
+	struct timespec nap = { 0, 100 * 1000 };
+	uint64_t pos = __atomic_load_n(&ring_head, __ATOMIC_RELAXED), seq;
+	struct log_cell *c;
+
+	for(;;)	{
+		c = &log_ring[pos % LOG_RING_SLOTS];
+		seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE);
+		if(seq == pos)	{
+			if(__atomic_compare_exchange_n(&ring_head, &pos, pos + 1, true,
+										   __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if(seq < pos)	{
+			/* Full: a debug line isn't worth the loop waiting on the disk,
+			 * it is counted and the flush thread reports the loss */
+			if(shed)	{
+				__atomic_fetch_add(&n_dropped, 1, __ATOMIC_RELAXED);
+				return;
+			}
+			if(!__atomic_load_n(&log_async, __ATOMIC_ACQUIRE))	{
+				write_lines(line, len);
+				return;
+			}
+			nanosleep(&nap, NULL);
+			pos = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+		} else {
+			pos = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+		}
+	}
+	memcpy(c->line, line, len);
+	c->len = len;
+	__atomic_store_n(&c->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+static void emit_line(const char *line, size_t len, bool shed)
+{
+	int saved = errno;
+
+	if(__atomic_load_n(&log_async, __ATOMIC_ACQUIRE))
+		ring_push(line, len, shed);
+	else
+		write_lines(line, len);
+	errno = saved;
+}
+
+/* Move what's in the ring, plus any drop notice, into @buf */
+static size_t drain_ring(char *buf)
+{
+	struct log_cell *c;
+	uint64_t lost;
+	size_t n = 0;
+	int m;
+
+	while(n + LOG_LINE_MAX <= LOG_BATCH)	{
+		c = &log_ring[ring_tail % LOG_RING_SLOTS];
+		if(__atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) != ring_tail + 1)
+			break;
+		memcpy(buf + n, c->line, c->len);
+		n += c->len;
+		__atomic_store_n(&c->seq, ring_tail + LOG_RING_SLOTS, __ATOMIC_RELEASE);
+		ring_tail++;
+	}
+
+	if(n + LOG_LINE_MAX <= LOG_BATCH &&
+	   (lost = __atomic_exchange_n(&n_dropped, 0, __ATOMIC_RELAXED)) > 0)	{
+		n += log_prefix(buf + n, LOG_LINE_MAX);
+		m = snprintf(buf + n, LOG_LINE_MAX / 2,
+					 "Log writes fell behind, %llu lines dropped\n",
+					 (unsigned long long)lost);
+		n += (m > 0) ? (size_t)m : 0;
+	}
+	return n;
+}
+
+/**
+ * Report the messages log_error() held back in seconds that are over
+ *
+ * Called by the flush thread on every pass and before each line written
+ * directly, so a count never waits for the next error to come.  The
+ * caller has read the clock.
+ *
+ * @all		report the current second's too, on the way out
+ * @direct	write here rather than through the ring (the flush thread)
+ */
+static void report_held(bool all, bool direct)
+{
+	uint64_t sec = (uint32_t)stamp_sec;
+	struct log_limit *l;
+	char line[LOG_LINE_MAX];
+	unsigned int held;
+	int i, m;
+	size_t n;
+
+	if(__atomic_load_n(&n_held, __ATOMIC_RELAXED) == 0)
+		return;
+
+	for(i = 0; i < LOG_LIMITS; i++)	{
+		l = &limits[i];
+		if(__atomic_load_n(&l->held, __ATOMIC_RELAXED) == 0 ||
+		   (!all && __atomic_load_n(&l->win, __ATOMIC_RELAXED) >> 32 == sec))
+			continue;
+		/* Whoever swaps the count out reports it */
+		if((held = __atomic_exchange_n(&l->held, 0, __ATOMIC_RELAXED)) == 0)
+			continue;
+		__atomic_fetch_sub(&n_held, held, __ATOMIC_RELAXED);
+
+		n = log_prefix(line, LOG_LINE_MAX / 2);
+		m = snprintf(line + n, LOG_LINE_MAX - n, "Held back %u more of \"%s\"\n",
+					 held, __atomic_load_n(&l->fmt, __ATOMIC_RELAXED));
+		if(m <= 0)
+			continue;
+		n = ((size_t)m < LOG_LINE_MAX - n) ? n + m : LOG_LINE_MAX;
+		line[n - 1] = '\n';
+		if(direct)
+			write_lines(line, n);
+		else
+			emit_line(line, n, false);
+	}
+}
+
+/**
+ * Should this error be held back as a repeat?  Counts it either way.
+ *
+ * Two threads bringing a new message at once may each take an entry for
+ * it, the second one is free again a second later.
+ */
+static bool error_held(const char *fmt)
+{
+	uint64_t sec = (uint32_t)stamp_sec, w, nw;
+	struct log_limit *l = NULL;
+	const char *f;
+	int i;
+
+	report_held(false, false);
+
+	for(i = 0; i < LOG_LIMITS && l == NULL; i++)
+		if(__atomic_load_n(&limits[i].fmt, __ATOMIC_RELAXED) == fmt)
+			l = &limits[i];
+	/* A free entry, or one nothing is held back on, can be taken */
+	for(i = 0; i < LOG_LIMITS && l == NULL; i++)	{
+		f = __atomic_load_n(&limits[i].fmt, __ATOMIC_RELAXED);
+		if(f != NULL &&
+		   (__atomic_load_n(&limits[i].held, __ATOMIC_RELAXED) != 0 ||
+			__atomic_load_n(&limits[i].win, __ATOMIC_RELAXED) >> 32 == sec))
+			continue;
+		if(__atomic_compare_exchange_n(&limits[i].fmt, &f, fmt, false,
+									   __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			l = &limits[i];
+	}
+	if(l == NULL)
+		return false;
+
+	/* A count from an earlier second, or the entry's last message, starts over */
+	w = __atomic_load_n(&l->win, __ATOMIC_RELAXED);
+	do	{
+		nw = (w >> 32 == sec) ? w + 1 : (sec << 32 | 1);
+	} while(!__atomic_compare_exchange_n(&l->win, &w, nw, true,
+										 __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	if((nw & 0xffffffff) <= LOG_REPEAT_MAX)
+		return false;
+	__atomic_fetch_add(&l->held, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&n_held, 1, __ATOMIC_RELAXED);
+	return true;
+}
+
+static void *flush_main(void *arg)
+{
+	static char buf[LOG_BATCH];
+	struct timespec nap = { 0, LOG_FLUSH_NSEC };
+	bool stop;
+	size_t n;
+
+	(void)arg;
+	for(;;)	{
+		stop = __atomic_load_n(&log_stopping, __ATOMIC_ACQUIRE);
+		log_clock();
+		if((n = drain_ring(buf)) > 0)	{
+			write_lines(buf, n);
+			continue;
+		}
+		report_held(stop, true);
+		if(stop)
+			break;
+		nanosleep(&nap, NULL);
+	}
+	return NULL;
+}
+
+/* Only the thread that forked exists in the child, the parent's ring is
+ * its own to write out */
+static void log_forked(void)
+{
+	log_async = false;
+	log_stopping = false;
+}
 
-	if(strftime(p, 63, "%m/%d %X", localtime(&t)) > 0)
-		fprintf(debug_stream, "%s %s: ", p, prog_name);
+/**
+ * Write what is still queued and go back to writing lines directly
+ *
+ * Runs at exit, so log_exit() from any thread leaves nothing behind.
+ */
+void log_stop_async(void)
+{
+	/* Only one thread gets to join */
+	if(!__atomic_exchange_n(&log_async, false, __ATOMIC_ACQ_REL))
+		return;
+	__atomic_store_n(&log_stopping, true, __ATOMIC_RELEASE);
+	pthread_join(flush_thread, NULL);
+	log_stopping = false;
 }
 
+/**
+ * Hand log lines to a flush thread from now on
+ *
+ * Lines are queued in a lock-free ring and written in batches, so the
+ * gateway loops don't wait on the log file.  Called once per process that
+ * runs gateways; a forked child starts writing directly again and must call
+ * this itself.  The flush thread blocks all signals, they stay with the loop.
+ */
+void log_start_async(void)
+{
+	static bool registered = false;
+	sigset_t all, old;
+	uint64_t i;
+	int rc;
+
+	if(log_async)
+		return;
+	if(log_ring == NULL)
+		log_ring = safemalloc(LOG_RING_SLOTS * sizeof(struct log_cell), "log ring");
+	for(i = 0; i < LOG_RING_SLOTS; i++)
+		log_ring[i].seq = i;
+	ring_head = ring_tail = n_dropped = 0;
+
+	if(!registered)	{
+		atexit(log_stop_async);
+		pthread_atfork(NULL, NULL, log_forked);
+		registered = true;
+	}
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	rc = pthread_create(&flush_thread, NULL, flush_main, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if(rc != 0)	{
+		log_msg("Can't start log thread, writing directly: %s", strerror(rc));
+		return;
+	}
+	__atomic_store_n(&log_async, true, __ATOMIC_RELEASE);
+}
 
 void log_exit_perror(int code, const char *fmt, ...)
 {
-	char buf[2048];
-	int our_error;
+	char line[LOG_LINE_MAX];
+	const char *err = strerror(errno);
 	va_list ap;
+	size_t n;
 
-	our_error = errno;
-	log_msg_init();
+	log_clock();
+	report_held(true, false);
 	va_start(ap, fmt);
-	vsnprintf(buf, 2046, fmt, ap);
+	n = format_line(line, err, fmt, ap);
 	va_end(ap);
-    fprintf(debug_stream, "%s: %s\n", buf, strerror(our_error));
+	log_stop_async();
+	emit_line(line, n, false);
 	exit(code);
 }
 
 void log_exit(int code, const char *fmt, ...)
 {
+	char line[LOG_LINE_MAX];
 	va_list ap;
-	log_msg_init();
+	size_t n;
+
+	log_clock();
+	report_held(true, false);
 	va_start(ap, fmt);
-	vfprintf(debug_stream, fmt, ap);
+	n = format_line(line, NULL, fmt, ap);
 	va_end(ap);
-	fputc('\n', debug_stream);
+	log_stop_async();
+	emit_line(line, n, false);
 	exit(code);
 }
 
 void log_msg(const char *fmt, ...)
 {
+	char line[LOG_LINE_MAX];
 	va_list ap;
-	log_msg_init();
+	size_t n;
+
+	log_clock();
+	report_held(false, false);
 	va_start(ap, fmt);
-	vfprintf(debug_stream, fmt, ap);
+	n = format_line(line, NULL, fmt, ap);
 	va_end(ap);
-	fputc('\n', debug_stream);
+	emit_line(line, n, false);
 }
 
-void debug(const char *fmt, ...)
+/* log_msg() for errors that come per connection or per read, a flood of
+ * one is cut to LOG_REPEAT_MAX lines a second and a count */
+void log_error(const char *fmt, ...)
 {
+	char line[LOG_LINE_MAX];
 	va_list ap;
-	if(_debug != 0)	{
-		log_msg_init();
-		va_start(ap, fmt);
-		vfprintf(debug_stream, fmt, ap);
-		va_end(ap);
-		fputc('\n', debug_stream);
-	}
+	size_t n;
+
+	log_clock();
+	if(error_held(fmt))
+		return;
+	va_start(ap, fmt);
+	n = format_line(line, NULL, fmt, ap);
+	va_end(ap);
+	emit_line(line, n, false);
+}
+
+/* Only reached through debug() with -d given, see util.h */
+void debug_msg(const char *fmt, ...)
+{
+	char line[LOG_LINE_MAX];
+	va_list ap;
+	size_t n;
+
+	log_clock();
+	va_start(ap, fmt);
+	n = format_line(line, NULL, fmt, ap);
+	va_end(ap);
+	emit_line(line, n, true);
+}
+
+uint64_t monotonic_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
 /* Returns zeroed block */
@@ -148,4 +553,97 @@ void del_fdmap(struct fd_map *fd)
 	free(fd);
 }
 
+/* Pointer-keyed hash table: open addressing, linear probing, kept at most
+ * half full.  Deletion shifts the following run back so there are no
+ * tombstones, every operation is O(1) on average.
+ */
+#define PTRMAP_INIT_SIZE 64
+
+static inline size_t ptrmap_slot(const struct ptr_map *m, const void *key)
+{
+	uint64_t h = (uintptr_t)key;
 
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return h & (m->size - 1);
+}
+
+struct ptr_map *new_ptrmap(void)
+{
+	struct ptr_map *m = safemalloc(sizeof(struct ptr_map), "new ptrmap");
+	m->size = PTRMAP_INIT_SIZE;
+	m->used = 0;
+	m->ent = safemalloc(m->size * sizeof(struct ptr_map_ent), "ptrmap entries");
+	return m;
+}
+
+static void grow_ptrmap(struct ptr_map *m)
+{
+	struct ptr_map_ent *old = m->ent;
+	size_t i, old_size = m->size;
+
+	m->size *= 2;
+	m->used = 0;
+	m->ent = safemalloc(m->size * sizeof(struct ptr_map_ent), "ptrmap: grow");
+	for(i = 0; i < old_size; i++)
+		if(old[i].key != NULL)
+			add_ptrmap(m, old[i].key, old[i].val);
+	free(old);
+}
+
+void add_ptrmap(struct ptr_map *m, const void *key, void *val)
+{
+	size_t i;
+
+	if(2 * (m->used + 1) > m->size)
+		grow_ptrmap(m);
+
+	for(i = ptrmap_slot(m, key); m->ent[i].key != NULL; i = (i + 1) & (m->size - 1))	{
+		if(m->ent[i].key == key)	{
+			m->ent[i].val = val;
+			return;
+		}
+	}
+	m->ent[i].key = key;
+	m->ent[i].val = val;
+	m->used++;
+}
+
+void *get_ptrmap(struct ptr_map *m, const void *key)
+{
+	size_t i;
+
+	for(i = ptrmap_slot(m, key); m->ent[i].key != NULL; i = (i + 1) & (m->size - 1))
+		if(m->ent[i].key == key)
+			return m->ent[i].val;
+	return NULL;
+}
+
+void remove_ptrmap(struct ptr_map *m, const void *key)
+{
+	size_t i, j, k, mask = m->size - 1;
+
+	for(i = ptrmap_slot(m, key); m->ent[i].key != key; i = (i + 1) & mask)
+		if(m->ent[i].key == NULL)
+			return;
+
+	m->ent[i].key = NULL;
+	m->used--;
+
+	/* Pull back any entry in the run that would be unreachable now */
+	for(j = (i + 1) & mask; m->ent[j].key != NULL; j = (j + 1) & mask)	{
+		k = ptrmap_slot(m, m->ent[j].key);
+		if((j > i && (k <= i || k > j)) || (j < i && (k <= i && k > j)))	{
+			m->ent[i] = m->ent[j];
+			m->ent[j].key = NULL;
+			i = j;
+		}
+	}
+}
+
+void del_ptrmap(struct ptr_map *m)
+{
+	free(m->ent);
+	free(m);
+}
@@ -0,0 +1,499 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "autotun.h"
+#include "config.h"
+#include "port_map.h"
+#include "net.h"
+#include "ssh.h"
+#include "stats.h"
+#include "worker.h"
+
+/*
+ * Worker-thread mode: instead of a process per gateway a fixed number of
+ * threads each drive several gateways.  Every gateway keeps its own epoll
+ * set, the worker waits on those sets (an epoll fd is pollable itself) and
+ * runs a pass of a gateway's loop when its set is ready.  A gateway is only
+ * ever touched by the worker that owns it, so moving one to another worker
+ * is just handing over a single descriptor.
+ */
+
+int n_workers = 0;
+
+static struct worker *workers;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The config the gateways follow, replaced on SIGHUP.  Each gateway applies
+ * a new one (under the read lock) on its next pass. */
+static pthread_rwlock_t config_lock = PTHREAD_RWLOCK_INITIALIZER;
+static struct ini_file *config_ini;
+static struct ini_section *config_sec;
+/* Bumped under the write lock, gateways poll it without taking the lock */
+static unsigned int config_gen;
+
+static inline unsigned int current_config_gen(void)
+{
+	return __atomic_load_n(&config_gen, __ATOMIC_ACQUIRE);
+}
+
+static int gw_load(struct gw_host *gw)
+{
+	int i, n = 0;
+
+	for(i = 0; i < gw->n_maps; i++)
+		n += gw->pm[i]->n_channels;
+	return n;
+}
+
+static void wake_worker(struct worker *w)
+{
+	char c = 0;
+
+	if(write(w->wake_fd[1], &c, 1) < 0 && errno != EAGAIN)
+		log_msg("Error waking worker %d: %s", w->idx, strerror(errno));
+}
+
+/* Start watching @gw's epoll set from @w, it must already be running */
+static void attach_gw(struct worker *w, struct gw_host *gw)
+{
+	saferealloc((void **)&w->gw, (w->n_gw + 1) * sizeof(gw), "worker gw array");
+	w->gw[w->n_gw++] = gw;
+	gw->worker_pass = w->pass;
+	add_fdmap(w->gw_fdmap, gw->ev->epfd, gw);
+	event_add(w->ev, gw->ev->epfd, EPOLLIN);
+}
+
+static void detach_gw(struct worker *w, struct gw_host *gw)
+{
+	int i;
+
+	for(i = 0; i < w->n_gw; i++)
+		if(w->gw[i] == gw)
+			break;
+	if(i == w->n_gw)
+		log_exit(FATAL_ERROR, "Error: gateway %s not on worker %d", gw->name, w->idx);
+
+	w->gw[i] = w->gw[--w->n_gw];
+	event_del(w->ev, gw->ev->epfd);
+	remove_fdmap(w->gw_fdmap, gw->ev->epfd);
+}
+
+static struct gw_host *get_gw_for_fd(struct worker *w, int fd)
+{
+	if(fd >= w->gw_fdmap->len)
+		return NULL;
+	return get_fdmap(w->gw_fdmap, fd);
+}
+
+/* Take the gateways other workers handed us */
+static void adopt_gws(struct worker *w)
+{
+	char drain[64];
+	int i;
+
+	while(read(w->wake_fd[0], drain, sizeof(drain)) > 0)
+		;
+
+	pthread_mutex_lock(&pool_lock);
+	for(i = 0; i < w->n_inbox; i++)	{
+		debug("Worker %d takes over %s", w->idx, w->inbox[i]->name);
+		attach_gw(w, w->inbox[i]);
+	}
+	w->n_inbox = 0;
+	pthread_mutex_unlock(&pool_lock);
+}
+
+/**
+ * Move a gateway to the least loaded worker if we carry a lot more
+ *
+ * Loads are channel counts, published by each worker when it checks.  The
+ * gateway moved is the busiest one that still narrows the gap, moving it
+ * costs nothing but the hand-over since its state never leaves memory.
+ *
+ * @w		worker doing the check
+ */
+static void rebalance(struct worker *w)
+{
+	struct worker *least = NULL;
+	struct gw_host *move = NULL;
+	int i, diff, load;
+
+	w->next_balance = monotonic_usec() + REBALANCE_USEC;
+
+	pthread_mutex_lock(&pool_lock);
+	w->load = 0;
+	for(i = 0; i < w->n_gw; i++)
+		w->load += gw_load(w->gw[i]);
+
+	for(i = 0; i < n_workers; i++)	{
+		if(!workers[i].running || &workers[i] == w)
+			continue;
+		if(least == NULL || workers[i].load < least->load)
+			least = &workers[i];
+	}
+
+	if(least == NULL || w->n_gw < 2 ||
+	   (diff = w->load - least->load) < REBALANCE_MIN_DIFF)	{
+		pthread_mutex_unlock(&pool_lock);
+		return;
+	}
+
+	for(i = 0; i < w->n_gw; i++)	{
+		load = gw_load(w->gw[i]);
+		if(load > 0 && load <= diff / 2 &&
+		   (move == NULL || load > gw_load(move)))
+			move = w->gw[i];
+	}
+
+	if(move != NULL)	{
+		load = gw_load(move);
+		log_msg("Moving %s (%d channels) from worker %d to %d",
+				move->name, load, w->idx, least->idx);
+		detach_gw(w, move);
+		saferealloc((void **)&least->inbox, (least->n_inbox + 1) * sizeof(move),
+					"worker inbox");
+		least->inbox[least->n_inbox++] = move;
+		w->load -= load;
+		least->load += load;
+		wake_worker(least);
+	}
+	pthread_mutex_unlock(&pool_lock);
+}
+
+static void retire_gw(struct worker *w, struct gw_host *gw)
+{
+	pthread_mutex_lock(&pool_lock);
+	detach_gw(w, gw);
+	pthread_mutex_unlock(&pool_lock);
+	gw_loop_end(gw);
+	destroy_gw(gw);
+}
+
+/* Apply the config the main thread published last, see reload_workers() */
+static void reload_worker_gw(struct gw_host *gw)
+{
+	pthread_rwlock_rdlock(&config_lock);
+	gw->config_gen = current_config_gen();
+	reload_gw(gw, config_sec);
+	pthread_rwlock_unlock(&config_lock);
+}
+
+/* Run a pass of @gw's loop unless it already had one this round */
+static void run_gw(struct worker *w, struct gw_host *gw, char *buf, size_t len)
+{
+	if(gw->worker_pass == w->pass)
+		return;
+
+	gw->worker_pass = w->pass;
+	if(gw->config_gen != current_config_gen())
+		reload_worker_gw(gw);
+	if(gw_loop_iter(gw, 0, buf, len))
+		retire_gw(w, gw);
+}
+
+/* Stop once we have no gateways and nobody is about to hand us one */
+static bool worker_done(struct worker *w)
+{
+	bool done;
+
+	pthread_mutex_lock(&pool_lock);
+	done = (w->n_gw == 0 && w->n_inbox == 0);
+	if(done)
+		w->running = false;
+	pthread_mutex_unlock(&pool_lock);
+	return done;
+}
+
+static void *worker_main(void *arg)
+{
+	struct worker *w = arg;
+	char *buf = safemalloc(CHAN_BUF_SIZE, "worker scratch buffer");
+	struct gw_host **start;
+	int i, n_start;
+
+	start = w->gw;
+	n_start = w->n_gw;
+	w->gw = NULL;
+	w->n_gw = 0;
+	for(i = 0; i < n_start; i++)	{
+		gw_loop_start(start[i]);
+		pthread_mutex_lock(&pool_lock);
+		attach_gw(w, start[i]);
+		pthread_mutex_unlock(&pool_lock);
+	}
+	free(start);
+
+	while(!__atomic_load_n(&hard_shutdown, __ATOMIC_RELAXED) && !worker_done(w))	{
+		int n_ready, timeout = 1000;
+		uint64_t now = monotonic_usec();
+
+		for(i = 0; i < w->n_gw; i++)	{
+			int t = gw_loop_timeout(w->gw[i]);
+			w->gw[i]->wake_at = now + (uint64_t)t * 1000;
+			if(t < timeout)
+				timeout = t;
+		}
+
+		if((n_ready = event_wait(w->ev, timeout)) < 0)
+			continue;
+
+		w->pass++;
+		for(i = 0; i < n_ready; i++)	{
+			int fd = w->ev->events[i].data.fd;
+			struct gw_host *gw;
+
+			if(fd == w->wake_fd[0])
+				adopt_gws(w);
+			else if((gw = get_gw_for_fd(w, fd)) != NULL)
+				run_gw(w, gw, buf, CHAN_BUF_SIZE);
+		}
+
+		/* Pending work, or a gateway whose own timeout has run out */
+		now = monotonic_usec();
+		for(i = w->n_gw - 1; i >= 0; i--)
+			if(n_ready == 0 || w->gw[i]->ready != NULL ||
+			   w->gw[i]->wake_at <= now ||
+			   w->gw[i]->config_gen != current_config_gen())
+				run_gw(w, w->gw[i], buf, CHAN_BUF_SIZE);
+
+		if(monotonic_usec() >= w->next_balance)
+			rebalance(w);
+	}
+
+	while(w->n_gw > 0)
+		retire_gw(w, w->gw[0]);
+	free(buf);
+
+	pthread_mutex_lock(&pool_lock);
+	w->running = false;
+	pthread_mutex_unlock(&pool_lock);
+	return NULL;
+}
+
+static int n_running(void)
+{
+	int i, n = 0;
+
+	pthread_mutex_lock(&pool_lock);
+	for(i = 0; i < n_workers; i++)
+		n += workers[i].running;
+	pthread_mutex_unlock(&pool_lock);
+	return n;
+}
+
+/* Is a live (not draining) gateway for this shard on any worker? */
+static bool have_gw(const char *name, int shard)
+{
+	int i, j;
+
+	for(i = 0; i < n_workers; i++)	{
+		struct worker *w = &workers[i];
+
+		for(j = 0; j < w->n_gw + w->n_inbox; j++)	{
+			struct gw_host *gw = (j < w->n_gw) ? w->gw[j] : w->inbox[j - w->n_gw];
+
+			if(gw->shard == shard && !__atomic_load_n(&gw->draining, __ATOMIC_RELAXED) &&
+			   strcmp(gw->name, name) == 0)
+				return true;
+		}
+	}
+	return false;
+}
+
+/* Hand a new gateway to the least loaded worker still running */
+static void deal_gw(struct gw_host *gw)
+{
+	struct worker *least = NULL;
+	int i;
+
+	gw_loop_start(gw);
+	gw->config_gen = current_config_gen();
+
+	pthread_mutex_lock(&pool_lock);
+	for(i = 0; i < n_workers; i++)
+		if(workers[i].running && (least == NULL || workers[i].load < least->load))
+			least = &workers[i];
+	if(least != NULL)	{
+		saferealloc((void **)&least->inbox, (least->n_inbox + 1) * sizeof(gw),
+					"worker inbox");
+		least->inbox[least->n_inbox++] = gw;
+		wake_worker(least);
+	}
+	pthread_mutex_unlock(&pool_lock);
+
+	if(least == NULL)	{
+		log_msg("No worker left to run %s", gw->name);
+		destroy_gw(gw);
+	}
+}
+
+/**
+ * Apply a changed config file to the gateways on the workers
+ *
+ * The new config is published under the write lock and the workers woken,
+ * each gateway then diffs its own maps on its next pass (see reload_gw()).
+ * Gateways (or shards) that are new in the config are built here and dealt
+ * to the least loaded worker.  Changes to a gateway's other settings only
+ * take effect on restart.
+ */
+static void reload_workers(void)
+{
+	struct ini_section *sec, *old;
+	struct ini_file *ini;
+	struct { struct ini_section *sec; int shard; } *add = NULL;
+	int i, shard, n_add = 0;
+
+	log_msg("Reloading config file %s", cfgfile);
+	if((ini = reread_configfile(cfgfile, &sec)) == NULL)
+		return;
+
+	pthread_rwlock_wrlock(&config_lock);
+	for(old = sec; old != NULL; old = old->next)	{
+		struct ini_section *prev = find_gw_section(config_sec, old->name);
+
+		if(prev != NULL && !same_gw_settings(prev, old))
+			log_msg("Settings of [%s] other than its maps changed, they take "
+					"effect on restart", old->name);
+	}
+	if(config_ini != NULL)
+		ini_free_data(config_ini);
+	config_ini = ini;
+	config_sec = sec;
+	__atomic_add_fetch(&config_gen, 1, __ATOMIC_RELEASE);
+
+	/* What's missing is decided against the gateways as they are now */
+	pthread_mutex_lock(&pool_lock);
+	for(; sec != NULL; sec = sec->next)	{
+		int n_shards = section_shards(sec);
+
+		for(shard = 0; shard < n_shards; shard++)	{
+			if(have_gw(sec->name, shard))
+				continue;
+			saferealloc((void **)&add, (n_add + 1) * sizeof(*add),
+						"new gateway list");
+			add[n_add].sec = sec;
+			add[n_add++].shard = shard;
+		}
+	}
+	pthread_mutex_unlock(&pool_lock);
+	pthread_rwlock_unlock(&config_lock);
+
+	for(i = 0; i < n_workers; i++)
+		wake_worker(&workers[i]);
+	for(i = 0; i < n_add; i++)	{
+		log_msg("Starting %s shard %d", add[i].sec->name, add[i].shard);
+		deal_gw(process_section_to_gw(add[i].sec, add[i].shard));
+	}
+	free(add);
+}
+
+/**
+ * Run every gateway in the config on a pool of worker threads
+ *
+ * The gateways at startup (each shard counting as one) are dealt out to
+ * the workers round-robin, ones added by a reload go to the least loaded
+ * worker, and all are rebalanced later by channel load.  The calling thread
+ * keeps handling signals and reloads and wakes the workers so they notice
+ * shutdown or stats requests right away.
+ *
+ * @sec		First gateway section of the config
+ * @n		Number of worker threads, capped at the number of gateways
+ * @return	0 once all gateways are done
+ */
+int run_workers(struct ini_section *sec, int n)
+{
+	struct timespec tick = {0, 250 * 1000 * 1000};
+	sigset_t block, old;
+	int i, shard, n_gw = 0;
+
+	for(struct ini_section *s = sec; s != NULL; s = s->next)
+		n_gw += section_shards(s);
+	if(n > n_gw)
+		n = n_gw;
+	n_workers = n;
+	config_sec = sec;
+
+	workers = safemalloc(n * sizeof(struct worker), "worker array");
+	for(i = 0; i < n; i++)	{
+		struct worker *w = &workers[i];
+
+		w->idx = i;
+		w->running = true;
+		w->ev = new_event_loop(EVENT_BATCH);
+		w->gw_fdmap = new_fdmap();
+		if(pipe(w->wake_fd) < 0)
+			log_exit_perror(FATAL_ERROR, "pipe() for worker %d", i);
+		set_nonblocking(w->wake_fd[0]);
+		set_nonblocking(w->wake_fd[1]);
+		event_add(w->ev, w->wake_fd[0], EPOLLIN);
+		w->next_balance = monotonic_usec() + REBALANCE_USEC;
+	}
+
+	/* Shards of a map land on different workers, that's the point of them */
+	for(i = 0; sec != NULL; sec = sec->next)	{
+		int n_shards = section_shards(sec);
+
+		for(shard = 0; shard < n_shards; shard++, i++)	{
+			struct worker *w = &workers[i % n];
+
+			saferealloc((void **)&w->gw, (w->n_gw + 1) * sizeof(struct gw_host *),
+						"worker gw array");
+			w->gw[w->n_gw++] = process_section_to_gw(sec, shard);
+		}
+	}
+
+	log_msg("Running %d gateways on %d worker threads", n_gw, n);
+
+	/* Signals are for this thread only, workers just look at the flags */
+	sigemptyset(&block);
+	sigaddset(&block, SIGINT);
+	sigaddset(&block, SIGTERM);
+	sigaddset(&block, SIGHUP);
+	sigaddset(&block, SIGUSR2);
+	pthread_sigmask(SIG_BLOCK, &block, &old);
+	for(i = 0; i < n; i++)
+		if(pthread_create(&workers[i].tid, NULL, worker_main, &workers[i]) != 0)
+			log_exit(FATAL_ERROR, "Error creating worker thread %d", i);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	while(n_running() > 0)	{
+		if(metrics_serving())
+			metrics_poll(tick.tv_nsec / 1000000);
+		else
+			nanosleep(&tick, NULL);
+		if(__atomic_load_n(&reload_config, __ATOMIC_RELAXED) &&
+		   !__atomic_load_n(&finish_main_loop, __ATOMIC_RELAXED))	{
+			__atomic_store_n(&reload_config, false, __ATOMIC_RELAXED);
+			reload_workers();
+		}
+		if(__atomic_load_n(&dump_stats, __ATOMIC_RELAXED) ||
+		   __atomic_load_n(&finish_main_loop, __ATOMIC_RELAXED) ||
+		   __atomic_load_n(&hard_shutdown, __ATOMIC_RELAXED))	{
+			__atomic_store_n(&dump_stats, false, __ATOMIC_RELAXED);
+			for(i = 0; i < n; i++)
+				wake_worker(&workers[i]);
+		}
+	}
+
+	for(i = 0; i < n; i++)	{
+		struct worker *w = &workers[i];
+
+		pthread_join(w->tid, NULL);
+		close(w->wake_fd[0]);
+		close(w->wake_fd[1]);
+		del_fdmap(w->gw_fdmap);
+		del_event_loop(w->ev);
+		free(w->gw);
+		free(w->inbox);
+	}
+	free(workers);
+	if(config_ini != NULL)
+		ini_free_data(config_ini);
+	return 0;
+}